@@ -5,6 +5,10 @@
 
 #include "Image.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace tga {
 
 // https://www.dca.fee.unicamp.br/~martino/disciplinas/ea978/tgaffs.pdf
@@ -167,6 +171,9 @@ Image::Image() {
 
 	pixelFormat = Image::EPF_NONE;
 	wrapping = Image::EWT_DISCARD;
+
+	mipmaps = NULL;
+	mipmapCount = 0;
 }
 
 Image::~Image() {
@@ -190,6 +197,10 @@ const uint8_t* Image::getData() const {
 	return data;
 }
 
+uint8_t* Image::getData() {
+	return data;
+}
+
 uint32_t Image::getDataLength() const {
 	return size.x * size.y * getPixelSize();
 }
@@ -560,6 +571,8 @@ void Image::clear() {
 }
 
 void Image::destroy() {
+	destroyMipmaps();
+
 	if (colorMapData != NULL) {
 		delete [] colorMapData;
 		colorMapData = NULL;
@@ -721,14 +734,16 @@ void Image::setPixelf(int x, int y, const vec4& color) {
 }
 
 vec4 Image::getPixelf(int x, int y) const {
-	vec4 ans;
-
 	if (updateCoordinates(x, y)) {
-		return ans;
+		return vec4();
 	}
 
-	uint32_t pixelIndex = y * size.x + x;
-	
+	return decodePixel(y * size.x + x);
+}
+
+vec4 Image::decodePixel(uint32_t pixelIndex) const {
+	vec4 ans;
+
 	switch (pixelFormat) {
 	case Image::EPF_INDEX_RGB :
 		ans.x = (float)colorMapData[data[pixelIndex] * 3 + 0] / 255.0f; // 2?
@@ -779,6 +794,221 @@ vec4 Image::getPixelf(int x, int y) const {
 vec4 Image::sample2D(const vec2& uv) const {
 	return getPixelf(uv.x * size.x, uv.y * size.y);
 }
+
+// Texel wrapping for the filtered samples. Discard is decided once for the
+// whole sample, so here it clamps, as does the unfinished mirror mode
+static inline int wrapTexel(int coordinate, int size, uint8_t wrapping) {
+	if (wrapping == Image::EWT_REPEAT) {
+		coordinate %= size;
+		return (coordinate < 0) ? coordinate + size : coordinate;
+	}
+
+	if (coordinate < 0) {
+		return 0;
+	}
+	if (coordinate >= size) {
+		return size - 1;
+	}
+	return coordinate;
+}
+
+// Byte order of Image::getPixelf, without the format switch
+template <uint8_t Format>
+static inline vec4 decodeTexel(const uint8_t* data, uint32_t pixelIndex) {
+	if (Format == Image::EPF_R8G8B8A8) {
+		const uint8_t* pixel = data + pixelIndex * 4;
+		return vec4(pixel[2], pixel[1], pixel[0], pixel[3]);
+	}
+	const uint8_t* pixel = data + pixelIndex * 3;
+	return vec4(pixel[2], pixel[1], pixel[0], 255.0f);
+}
+
+template <uint8_t Format>
+static inline vec4 blendTexels(const uint8_t* data, const uint32_t index[4], float fx, float fy) {
+	const vec4 top = decodeTexel<Format>(data, index[0]) * (1.0f - fx) + decodeTexel<Format>(data, index[1]) * fx;
+	const vec4 bottom = decodeTexel<Format>(data, index[2]) * (1.0f - fx) + decodeTexel<Format>(data, index[3]) * fx;
+	return (top * (1.0f - fy) + bottom * fy) * (1.0f / 255.0f);
+}
+
+#if defined(__SSE2__)
+static inline __m128 loadTexel(const uint8_t* data, uint32_t pixelIndex) {
+	int32_t texel;
+	memcpy(&texel, data + pixelIndex * 4, sizeof(texel));
+
+	const __m128i zero = _mm_setzero_si128();
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(texel), zero), zero));
+}
+
+template <>
+inline vec4 blendTexels<Image::EPF_R8G8B8A8>(const uint8_t* data, const uint32_t index[4], float fx, float fy) {
+	const __m128 weightX = _mm_set1_ps(fx);
+	const __m128 weightY = _mm_set1_ps(fy);
+
+	const __m128 t0 = loadTexel(data, index[0]);
+	const __m128 t2 = loadTexel(data, index[2]);
+	const __m128 top = _mm_add_ps(t0, _mm_mul_ps(_mm_sub_ps(loadTexel(data, index[1]), t0), weightX));
+	const __m128 bottom = _mm_add_ps(t2, _mm_mul_ps(_mm_sub_ps(loadTexel(data, index[3]), t2), weightX));
+	__m128 color = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), weightY));
+
+	// BGRA to RGBA
+	color = _mm_mul_ps(_mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 0, 1, 2)), _mm_set1_ps(1.0f / 255.0f));
+
+	float result[4];
+	_mm_storeu_ps(result, color);
+	return vec4(result[0], result[1], result[2], result[3]);
+}
+#endif
+
+vec4 Image::sampleBilinear(const vec2& uv, const Image* level) const {
+	const int width = level->size.x;
+	const int height = level->size.y;
+
+	// Texel centers are at half coordinates
+	const float x = uv.x * width - 0.5f;
+	const float y = uv.y * height - 0.5f;
+	const float floorX = floorf(x);
+	const float floorY = floorf(y);
+	const float fx = x - floorX;
+	const float fy = y - floorY;
+
+	const int x0 = wrapTexel((int)floorX, width, wrapping.x);
+	const int x1 = wrapTexel((int)floorX + 1, width, wrapping.x);
+	const int y0 = wrapTexel((int)floorY, height, wrapping.y) * width;
+	const int y1 = wrapTexel((int)floorY + 1, height, wrapping.y) * width;
+	const uint32_t index[4] = {(uint32_t)(y0 + x0), (uint32_t)(y0 + x1), (uint32_t)(y1 + x0), (uint32_t)(y1 + x1)};
+
+	switch (pixelFormat) {
+	case EPF_R8G8B8A8 :
+		return blendTexels<EPF_R8G8B8A8>(level->data, index, fx, fy);
+	case EPF_R8G8B8 :
+		return blendTexels<EPF_R8G8B8>(level->data, index, fx, fy);
+	default :
+		break;
+	}
+
+	const vec4 top = level->decodePixel(index[0]) * (1.0f - fx) + level->decodePixel(index[1]) * fx;
+	const vec4 bottom = level->decodePixel(index[2]) * (1.0f - fx) + level->decodePixel(index[3]) * fx;
+
+	return top * (1.0f - fy) + bottom * fy;
+}
+
+vec4 Image::sample2D(const vec2& uv, const vec2& ddx, const vec2& ddy) const {
+	if ((data == NULL) || (pixelFormat == EPF_INDEX_RGB) || (pixelFormat == EPF_INDEX_RGBA)) {
+		return sample2D(uv);
+	}
+
+	if (((wrapping.x == EWT_DISCARD) && ((uv.x < 0.0f) || (uv.x > 1.0f))) ||
+		((wrapping.y == EWT_DISCARD) && ((uv.y < 0.0f) || (uv.y > 1.0f)))) {
+		return vec4();
+	}
+
+	// Footprint of the pixel in level 0 texels
+	const float dxLength = (ddx.x * size.x) * (ddx.x * size.x) + (ddx.y * size.y) * (ddx.y * size.y);
+	const float dyLength = (ddy.x * size.x) * (ddy.x * size.x) + (ddy.y * size.y) * (ddy.y * size.y);
+	const float footprint = (dxLength > dyLength) ? dxLength : dyLength;
+
+	// log2 of the squared length is twice the level
+	float lod = (footprint > 1.0f) ? 0.5f * log2f(footprint) : 0.0f;
+	if (lod >= (float)mipmapCount) {
+		return sampleBilinear(uv, getMipmap(mipmapCount));
+	}
+
+	const uint32_t level = (uint32_t)lod;
+	const float blend = lod - (float)level;
+	const vec4 nearer = sampleBilinear(uv, getMipmap(level));
+	if (blend <= 0.0f) {
+		return nearer;
+	}
+
+	return nearer * (1.0f - blend) + sampleBilinear(uv, getMipmap(level + 1)) * blend;
+}
+
+bool Image::generateMipmaps() {
+	destroyMipmaps();
+
+	if ((data == NULL) || (pixelFormat == EPF_INDEX_RGB) || (pixelFormat == EPF_INDEX_RGBA)) {
+		return false;
+	}
+
+	uint32_t count = 0;
+	for (Vector2u levelSize = size; (levelSize.x > 1) || (levelSize.y > 1); ++count) {
+		levelSize.x = (levelSize.x > 1) ? levelSize.x / 2 : 1;
+		levelSize.y = (levelSize.y > 1) ? levelSize.y / 2 : 1;
+	}
+
+	if (count == 0) {
+		return true;
+	}
+
+	mipmaps = new Image[count];
+	mipmapCount = count;
+
+	const uint32_t pixelSize = getPixelSize();
+	const Image* source = this;
+
+	for (uint32_t index = 0; index < count; ++index) {
+		Image& level = mipmaps[index];
+		const Vector2u sourceSize = source->size;
+		level.create(Vector2u((sourceSize.x > 1) ? sourceSize.x / 2 : 1, (sourceSize.y > 1) ? sourceSize.y / 2 : 1), (PIXEL_FORMAT)pixelFormat);
+		level.wrapping = wrapping;
+
+		for (uint32_t y = 0; y < level.size.y; ++y) {
+			// Odd sizes drop the last row or column, a 1 texel side is reused
+			const uint32_t y0 = (y * 2 < sourceSize.y) ? y * 2 : sourceSize.y - 1;
+			const uint32_t y1 = (y * 2 + 1 < sourceSize.y) ? y * 2 + 1 : sourceSize.y - 1;
+
+			for (uint32_t x = 0; x < level.size.x; ++x) {
+				const uint32_t x0 = (x * 2 < sourceSize.x) ? x * 2 : sourceSize.x - 1;
+				const uint32_t x1 = (x * 2 + 1 < sourceSize.x) ? x * 2 + 1 : sourceSize.x - 1;
+
+				const uint32_t index00 = y0 * sourceSize.x + x0;
+				const uint32_t index01 = y0 * sourceSize.x + x1;
+				const uint32_t index10 = y1 * sourceSize.x + x0;
+				const uint32_t index11 = y1 * sourceSize.x + x1;
+				const uint32_t target = y * level.size.x + x;
+
+				if (pixelFormat == EPF_DEPTH) {
+					level.fdata[target] = (source->fdata[index00] + source->fdata[index01] + source->fdata[index10] + source->fdata[index11]) * 0.25f;
+					continue;
+				}
+
+				// Every other format is made of byte channels
+				for (uint32_t channel = 0; channel < pixelSize; ++channel) {
+					const uint32_t sum =
+						source->data[index00 * pixelSize + channel] + source->data[index01 * pixelSize + channel] +
+						source->data[index10 * pixelSize + channel] + source->data[index11 * pixelSize + channel];
+					level.data[target * pixelSize + channel] = (sum + 2) / 4;
+				}
+			}
+		}
+
+		source = &level;
+	}
+
+	return true;
+}
+
+void Image::destroyMipmaps() {
+	if (mipmaps != NULL) {
+		delete [] mipmaps;
+		mipmaps = NULL;
+		mipmapCount = 0;
+	}
+}
+
+uint32_t Image::getMipmapCount() const {
+	return mipmapCount;
+}
+
+const Image* Image::getMipmap(uint32_t level) const {
+	if (level == 0) {
+		return this;
+	}
+	if (level > mipmapCount) {
+		return NULL;
+	}
+	return &mipmaps[level - 1];
+}
 	
 void Image::drawLine(const ivec2& begin, const ubvec4& beginColor, const ivec2& end, const ubvec4& endColor) {
 	float xdiff = (end.x - begin.x);
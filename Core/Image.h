@@ -17,6 +17,10 @@ protected:
 	uint8_t pixelFormat;
 	Vector2u size;
 
+	// Levels 1 and up, level 0 is the image itself
+	Image* mipmaps;
+	uint32_t mipmapCount;
+
 	// Make the copy operation illegal
 	Image(const Image& other){}
 	Image& operator = (const Image& other) {return *this;}
@@ -24,6 +28,10 @@ protected:
 	bool readColorMapData(uint8_t* colorMap, uint32_t depth, uint32_t length, FILE* file);
 	bool readUncompressedPixelData(uint8_t* pixels, uint32_t depth, uint32_t width, uint32_t height, FILE* file);
 	bool readCompressedPixelData(uint8_t* pixels, uint32_t depth, uint32_t width, uint32_t height, FILE* file);
+
+	vec4 decodePixel(uint32_t pixelIndex) const;
+
+	vec4 sampleBilinear(const vec2& uv, const Image* level) const;
 	
 public:
 	/*************************************************************************/
@@ -67,6 +75,8 @@ public:
 	
 	const uint8_t* getData() const;
 
+	uint8_t* getData();
+
 	virtual uint32_t getDataLength() const;
 
 	Vector2u getSize() const;
@@ -89,6 +99,18 @@ public:
 
 	void destroy();
 
+	/*************************************************************************/
+	/* Builds every level down to 1x1 with a 2x2 box filter. Indexed images  */
+	/* are not supported. Has to be called again after the pixels change.    */
+	/*************************************************************************/
+	bool generateMipmaps();
+
+	void destroyMipmaps();
+
+	uint32_t getMipmapCount() const;
+
+	const Image* getMipmap(uint32_t level) const;
+
 	virtual void setPixel(int x, int y, const ubvec4& color);
 	
 	virtual const ubvec4 getPixel(int x, int y) const;
@@ -98,6 +120,12 @@ public:
 	virtual vec4 getPixelf(int x, int y) const;
 	
 	virtual vec4 sample2D(const vec2& uv) const;
+
+	/*************************************************************************/
+	/* Trilinear sample. The level of detail comes from the screen space uv  */
+	/* derivatives, levels are bilinearly filtered and blended.              */
+	/*************************************************************************/
+	virtual vec4 sample2D(const vec2& uv, const vec2& ddx, const vec2& ddy) const;
 	
 	virtual void drawLine(const ivec2& begin, const ubvec4& beginColor, const ivec2& end, const ubvec4& endColor);
 	
@@ -1,6 +1,8 @@
 #ifndef __CAMERA_H__
 #define __CAMERA_H__
 
+#include "Frustum.h"
+
 struct Camera {
 	vec3 position;
 	vec3 rotation;
@@ -18,6 +20,9 @@ struct Camera {
 	mat4 projection;
 	mat4 viewProjection;
 
+	// Planes of viewProjection, in world space
+	Frustum frustum;
+
 	bool viewDirty;
 	bool projectionDirty;
 	bool viewProjectionDirty;
@@ -33,6 +38,7 @@ struct Camera {
 		view.setIdentity();
 		projection.setIdentity();
 		viewProjection.setIdentity();
+		frustum.set(viewProjection);
 
 		viewDirty = true;
 		projectionDirty = true;
@@ -54,6 +60,7 @@ struct Camera {
 
 		if (viewProjectionDirty == true) {
 			viewProjection = projection * view;
+			frustum.set(viewProjection);
 			viewProjectionDirty = false;
 		}
 	}
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "CommandBuffer.h"
+
+// At least the alignment of any uniform struct, as if it was on the stack
+static const unsigned int UniformAlignment = 16;
+
+CommandBuffer::CommandBuffer() {
+	reset();
+}
+
+void CommandBuffer::reset() {
+	draws.clear();
+	uniformData.clear();
+
+	state.shader = NULL;
+	state.textureMask = 0;
+	state.flagMask = 0;
+	state.flagValues = 0;
+	for (unsigned int index = 0; index < MaxTextureCount; ++index) {
+		state.texture[index] = NULL;
+	}
+	state.uniformOffset = NoUniform;
+	state.depth = 0.0f;
+}
+
+void CommandBuffer::setFlag(Renderer::RenderFlag renderFlag, bool value) {
+	const unsigned int bit = 1 << renderFlag;
+
+	state.flagMask |= bit;
+	state.flagValues = value ? (state.flagValues | bit) : (state.flagValues & ~bit);
+}
+
+void CommandBuffer::setActiveTexture(unsigned int index, const Image* image) {
+	if (index >= MaxTextureCount) {
+		return;
+	}
+
+	state.textureMask |= 1 << index;
+	state.texture[index] = image;
+}
+
+void CommandBuffer::setShader(Shader* shader) {
+	state.shader = shader;
+}
+
+void CommandBuffer::setUniform(const void* data, unsigned int size) {
+	const unsigned int offset = (uniformData.size() + UniformAlignment - 1) & ~(UniformAlignment - 1);
+
+	uniformData.resize(offset + size);
+	memcpy(&uniformData[offset], data, size);
+	state.uniformOffset = offset;
+}
+
+void CommandBuffer::setDepth(float depth) {
+	state.depth = depth;
+}
+
+CommandBuffer::Draw& CommandBuffer::addDraw(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount) {
+	draws.push_back(state);
+
+	Draw& draw = draws.back();
+	draw.primitiveType = primitiveType;
+	draw.vertices = vertices;
+	draw.vertexCount = vertexCount;
+	draw.indices = indices;
+	draw.indexCount = indexCount;
+	draw.instanceData = NULL;
+	draw.instanceCount = 0;
+
+	return draw;
+}
+
+void CommandBuffer::render(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount) {
+	addDraw(primitiveType, vertices, vertexCount, NULL, 0);
+}
+
+void CommandBuffer::render(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount) {
+	addDraw(primitiveType, vertices, vertexCount, indices, indexCount);
+}
+
+void CommandBuffer::renderInstanced(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const void* instanceData, unsigned int instanceCount) {
+	Draw& draw = addDraw(primitiveType, vertices, vertexCount, NULL, 0);
+	draw.instanceData = instanceData;
+	draw.instanceCount = instanceCount;
+}
+
+unsigned int CommandBuffer::getDrawCount() const {
+	return draws.size();
+}
+
+const CommandBuffer::Draw& CommandBuffer::getDraw(unsigned int index) const {
+	return draws[index];
+}
+
+void* CommandBuffer::getUniform(const Draw& draw) {
+	if (draw.uniformOffset == NoUniform) {
+		return NULL;
+	}
+
+	return &uniformData[draw.uniformOffset];
+}
@@ -0,0 +1,93 @@
+#ifndef __COMMAND_BUFFER_H__
+#define __COMMAND_BUFFER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "Renderer.h"
+
+/*****************************************************************************/
+/* Draws recorded for a later Renderer::submit(). The state calls only set   */
+/* the state the following draws are recorded with, nothing reaches the      */
+/* renderer before submission. State left unset keeps the value the renderer */
+/* has at submission. Vertex and index arrays are not copied and have to live*/
+/* until then. A buffer belongs to a single thread, several threads record   */
+/* one buffer each and submit them together.                                 */
+/*****************************************************************************/
+class CommandBuffer {
+public:
+	// Draw::uniformOffset of draws without a uniform
+	static const unsigned int NoUniform = 0xffffffff;
+
+	struct Draw {
+		Renderer::PrimitiveType primitiveType;
+		const Vertex* vertices;
+		unsigned int vertexCount;
+		const unsigned int* indices;
+		unsigned int indexCount;
+
+		// Not copied either, instanceCount is 0 for draws that are not instanced
+		const void* instanceData;
+		unsigned int instanceCount;
+
+		// NULL when not set
+		Shader* shader;
+
+		// Bit per texture unit and per Renderer::RenderFlag that was set
+		unsigned int textureMask;
+		unsigned int flagMask;
+		unsigned int flagValues;
+		const Image* texture[MaxTextureCount];
+
+		unsigned int uniformOffset;
+
+		// Distance from the eye, for front to back ordering
+		float depth;
+	};
+
+private:
+	std::vector<Draw> draws;
+
+	// Copies of the uniforms, every one starting on a UniformAlignment boundary
+	std::vector<uint8_t> uniformData;
+
+	// State of the next draw
+	Draw state;
+
+	Draw& addDraw(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount);
+
+public:
+	CommandBuffer();
+
+	// Drops every draw and the recording state
+	void reset();
+
+	void setFlag(Renderer::RenderFlag renderFlag, bool value);
+
+	void setActiveTexture(unsigned int index, const Image* image);
+
+	void setShader(Shader* shader);
+
+	/*************************************************************************/
+	/* Copies size bytes, handed to the shader as Shader::uniform by every   */
+	/* following draw. The data may go out of scope right after the call.    */
+	/*************************************************************************/
+	void setUniform(const void* data, unsigned int size);
+
+	void setDepth(float depth);
+
+	void render(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount);
+
+	void render(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount);
+
+	void renderInstanced(Renderer::PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount, const void* instanceData, unsigned int instanceCount);
+
+	unsigned int getDrawCount() const;
+
+	const Draw& getDraw(unsigned int index) const;
+
+	// NULL for draws without a uniform
+	void* getUniform(const Draw& draw);
+};
+
+#endif // __COMMAND_BUFFER_H__
@@ -0,0 +1,73 @@
+#include "FragmentBuffer.h"
+
+FragmentBuffer::FragmentBuffer() {
+	fragmentCount = 0;
+}
+
+void FragmentBuffer::resize(const uvec2& newSize) {
+	if (size == newSize) {
+		return;
+	}
+
+	size = newSize;
+	heads.assign(size.x * size.y, EndOfList);
+	if (arena.size() < heads.size()) {
+		arena.resize(heads.size());
+	}
+	fragmentCount = 0;
+}
+
+const uvec2& FragmentBuffer::getSize() const {
+	return size;
+}
+
+bool FragmentBuffer::insert(int x, int y, const vec4& color, float depth) {
+	const unsigned int index = fragmentCount.fetch_add(1, std::memory_order_relaxed);
+	if (index >= arena.size()) {
+		return false;
+	}
+
+	// Only one thread ever owns a pixel, the head needs no atomic exchange
+	unsigned int& head = heads[y * size.x + x];
+	Fragment& fragment = arena[index];
+	fragment.color = color;
+	fragment.depth = depth;
+	fragment.next = head;
+	head = index;
+
+	return true;
+}
+
+unsigned int FragmentBuffer::takeList(int x, int y) {
+	unsigned int& head = heads[y * size.x + x];
+	const unsigned int list = head;
+	head = EndOfList;
+
+	return list;
+}
+
+const FragmentBuffer::Fragment& FragmentBuffer::getFragment(unsigned int index) const {
+	return arena[index];
+}
+
+void FragmentBuffer::reset() {
+	const unsigned int count = fragmentCount;
+	if (count > arena.size()) {
+		// A quarter more than needed, so a slowly growing scene does not resize every frame
+		arena.resize(count + count / 4);
+	}
+	fragmentCount = 0;
+}
+
+unsigned int FragmentBuffer::getFragmentCount() const {
+	return fragmentCount;
+}
+
+unsigned int FragmentBuffer::getCapacity() const {
+	return arena.size();
+}
+
+void FragmentBuffer::clear() {
+	heads.assign(heads.size(), EndOfList);
+	fragmentCount = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef __FRAGMENT_BUFFER_H__
+#define __FRAGMENT_BUFFER_H__
+
+#include <atomic>
+#include <vector>
+
+#include "Vector.h"
+
+/*****************************************************************************/
+/* Per pixel linked lists of blended fragments, for order independent        */
+/* transparency. Every pixel holds the index of its last fragment, the       */
+/* fragments themselves come from a single arena shared by the whole frame.  */
+/* Coordinates follow the rasterizer, with y pointing up.                    */
+/*****************************************************************************/
+class FragmentBuffer {
+public:
+	// Index of an empty list
+	static const unsigned int EndOfList = 0xffffffff;
+
+	struct Fragment {
+		vec4 color;
+		float depth;
+		unsigned int next;
+	};
+
+private:
+	uvec2 size;
+	std::vector<unsigned int> heads;
+	std::vector<Fragment> arena;
+
+	// Fragments asked for since the last reset, may exceed the arena
+	std::atomic<unsigned int> fragmentCount;
+
+	// Make the copy operation illegal
+	FragmentBuffer(const FragmentBuffer&) {}
+	FragmentBuffer& operator = (const FragmentBuffer&) {return *this;}
+
+public:
+	FragmentBuffer();
+
+	/*************************************************************************/
+	/* Matches the color buffer size and empties every list. The arena       */
+	/* starts with room for one fragment per pixel.                          */
+	/*************************************************************************/
+	void resize(const uvec2& newSize);
+
+	const uvec2& getSize() const;
+
+	/*************************************************************************/
+	/* Prepends a fragment to the list of pixel (x, y). Safe from several    */
+	/* threads as long as they write different pixels. Returns false and     */
+	/* drops the fragment when the arena is full.                            */
+	/*************************************************************************/
+	bool insert(int x, int y, const vec4& color, float depth);
+
+	// Detaches the list of pixel (x, y), the pixel is empty afterwards
+	unsigned int takeList(int x, int y);
+
+	const Fragment& getFragment(unsigned int index) const;
+
+	/*************************************************************************/
+	/* Empties the arena once every list was taken. When fragments were      */
+	/* dropped the arena grows, so the same frame fits the next time.        */
+	/*************************************************************************/
+	void reset();
+
+	// Every fragment asked for since the last reset, including dropped ones
+	unsigned int getFragmentCount() const;
+
+	unsigned int getCapacity() const;
+
+	// Drops every list without compositing it
+	void clear();
+};
+
+#endif // __FRAGMENT_BUFFER_H__
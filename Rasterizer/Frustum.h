@@ -0,0 +1,106 @@
+#ifndef __FRUSTUM_H__
+#define __FRUSTUM_H__
+
+#include <math.h>
+
+#include "Vector.h"
+#include "Matrix4.h"
+
+/*****************************************************************************/
+/* The six planes of a view projection matrix, in the space the matrix       */
+/* transforms from. A point is inside when its clip position satisfies       */
+/* -w <= x, y, z <= w, the same planes the renderer clips against, so        */
+/* whatever is outside of one of them can not produce a single pixel.        */
+/*****************************************************************************/
+struct Frustum {
+	// Plane mask of the hierarchical box test, one bit per plane
+	static const unsigned int AllPlanes = 0x3f;
+
+	// Plane (a, b, c, d) keeps the points with a * x + b * y + c * z + d >= 0
+	vec4 planes[6];
+
+	Frustum() {
+	}
+
+	explicit Frustum(const mat4& viewProjection) {
+		set(viewProjection);
+	}
+
+	void set(const mat4& viewProjection) {
+		// Rows of the matrix, the clip position is (row0, row1, row2, row3) . (x, y, z, 1)
+		vec4 row[4];
+		for (unsigned int index = 0; index < 4; ++index) {
+			row[index] = vec4(viewProjection[index], viewProjection[4 + index], viewProjection[8 + index], viewProjection[12 + index]);
+		}
+
+		// Left, right, bottom, top, near and far, w + x, w - x and so on
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			planes[axis * 2 + 0] = row[3] + row[axis];
+			planes[axis * 2 + 1] = row[3] - row[axis];
+		}
+
+		// Unit normals, so a plane also gives the distance for sphere tests
+		for (unsigned int index = 0; index < 6; ++index) {
+			vec4& plane = planes[index];
+			const float length = sqrtf(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+			if (length > 0.0f) {
+				plane *= 1.0f / length;
+			}
+		}
+	}
+
+	bool isSphereOutside(const vec3& center, float radius) const {
+		for (unsigned int index = 0; index < 6; ++index) {
+			const vec4& plane = planes[index];
+			if (plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w < -radius) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*************************************************************************/
+	/* Only tests the corner of the box furthest along each plane normal,    */
+	/* so a box crossing two planes near a frustum corner may pass even      */
+	/* when it is outside. It never fails a box that is partly inside.       */
+	/*************************************************************************/
+	bool isBoxOutside(const vec3& minimum, const vec3& maximum) const {
+		for (unsigned int index = 0; index < 6; ++index) {
+			const vec4& plane = planes[index];
+			const float x = (plane.x >= 0.0f) ? maximum.x : minimum.x;
+			const float y = (plane.y >= 0.0f) ? maximum.y : minimum.y;
+			const float z = (plane.z >= 0.0f) ? maximum.z : minimum.z;
+			if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*************************************************************************/
+	/* Same test for hierarchies. Only the planes in planeMask are tested,   */
+	/* and the planes the box is completely inside of are cleared from it,   */
+	/* so whatever the box contains can skip them. A mask of 0 means the box */
+	/* is inside the frustum.                                                */
+	/*************************************************************************/
+	bool isBoxOutside(const vec3& minimum, const vec3& maximum, unsigned int& planeMask) const {
+		for (unsigned int index = 0; index < 6; ++index) {
+			if ((planeMask & (1 << index)) == 0) {
+				continue;
+			}
+
+			const vec4& plane = planes[index];
+			const vec3 nearest((plane.x >= 0.0f) ? minimum.x : maximum.x, (plane.y >= 0.0f) ? minimum.y : maximum.y, (plane.z >= 0.0f) ? minimum.z : maximum.z);
+			const vec3 furthest((plane.x >= 0.0f) ? maximum.x : minimum.x, (plane.y >= 0.0f) ? maximum.y : minimum.y, (plane.z >= 0.0f) ? maximum.z : minimum.z);
+			if (plane.x * furthest.x + plane.y * furthest.y + plane.z * furthest.z + plane.w < 0.0f) {
+				return true;
+			}
+			if (plane.x * nearest.x + plane.y * nearest.y + plane.z * nearest.z + plane.w >= 0.0f) {
+				planeMask &= ~(1 << index);
+			}
+		}
+		return false;
+	}
+};
+
+#endif // __FRUSTUM_H__
@@ -0,0 +1,108 @@
+#include <stdio.h>
+
+#include "HierarchicalZ.h"
+
+static const unsigned int TileBlocks = HierarchicalZ::TileSize / HierarchicalZ::BlockSize;
+
+HierarchicalZ::HierarchicalZ() {
+	valid = false;
+}
+
+void HierarchicalZ::resize(const uvec2& newSize) {
+	valid = false;
+
+	if (size == newSize) {
+		return;
+	}
+
+	size = newSize;
+	blockCount = uvec2((size.x + BlockSize - 1) / BlockSize, (size.y + BlockSize - 1) / BlockSize);
+	tileCount = uvec2((size.x + TileSize - 1) / TileSize, (size.y + TileSize - 1) / TileSize);
+	blocks.resize(blockCount.x * blockCount.y);
+	tiles.resize(tileCount.x * tileCount.y);
+}
+
+void HierarchicalZ::clear(float depth) {
+	Bounds bounds;
+	bounds.minDepth = depth;
+	bounds.maxDepth = depth;
+
+	for (unsigned int index = 0; index < blocks.size(); ++index) {
+		blocks[index] = bounds;
+	}
+	for (unsigned int index = 0; index < tiles.size(); ++index) {
+		tiles[index] = bounds;
+	}
+
+	valid = true;
+}
+
+void HierarchicalZ::invalidate() {
+	valid = false;
+}
+
+bool HierarchicalZ::isValid() const {
+	return valid;
+}
+
+const uvec2& HierarchicalZ::getSize() const {
+	return size;
+}
+
+const HierarchicalZ::Bounds& HierarchicalZ::getBlock(unsigned int blockX, unsigned int blockY) const {
+	return blocks[blockY * blockCount.x + blockX];
+}
+
+const HierarchicalZ::Bounds& HierarchicalZ::getTile(unsigned int tileX, unsigned int tileY) const {
+	return tiles[tileY * tileCount.x + tileX];
+}
+
+void HierarchicalZ::updateTile(unsigned int tileX, unsigned int tileY) {
+	const unsigned int firstX = tileX * TileBlocks;
+	const unsigned int firstY = tileY * TileBlocks;
+	const unsigned int lastX = (firstX + TileBlocks < blockCount.x) ? firstX + TileBlocks : blockCount.x;
+	const unsigned int lastY = (firstY + TileBlocks < blockCount.y) ? firstY + TileBlocks : blockCount.y;
+
+	Bounds bounds = blocks[firstY * blockCount.x + firstX];
+	for (unsigned int blockY = firstY; blockY < lastY; ++blockY) {
+		for (unsigned int blockX = firstX; blockX < lastX; ++blockX) {
+			const Bounds& block = blocks[blockY * blockCount.x + blockX];
+			if (block.minDepth < bounds.minDepth) {
+				bounds.minDepth = block.minDepth;
+			}
+			if (block.maxDepth > bounds.maxDepth) {
+				bounds.maxDepth = block.maxDepth;
+			}
+		}
+	}
+
+	tiles[tileY * tileCount.x + tileX] = bounds;
+}
+
+void HierarchicalZ::updateBlock(unsigned int blockX, unsigned int blockY, const float* depth) {
+	const unsigned int x0 = blockX * BlockSize;
+	const unsigned int y0 = blockY * BlockSize;
+	const unsigned int x1 = (x0 + BlockSize < size.x) ? x0 + BlockSize : size.x;
+	const unsigned int y1 = (y0 + BlockSize < size.y) ? y0 + BlockSize : size.y;
+
+	float minDepth = depth[(size.y - 1 - y0) * size.x + x0];
+	float maxDepth = minDepth;
+
+	for (unsigned int y = y0; y < y1; ++y) {
+		// The depth buffer is stored top down
+		const float* row = depth + (size.y - 1 - y) * size.x;
+		for (unsigned int x = x0; x < x1; ++x) {
+			minDepth = (row[x] < minDepth) ? row[x] : minDepth;
+			maxDepth = (row[x] > maxDepth) ? row[x] : maxDepth;
+		}
+	}
+
+	Bounds& block = blocks[blockY * blockCount.x + blockX];
+	if ((block.minDepth == minDepth) && (block.maxDepth == maxDepth)) {
+		return;
+	}
+
+	block.minDepth = minDepth;
+	block.maxDepth = maxDepth;
+	updateTile(blockX / TileBlocks, blockY / TileBlocks);
+}
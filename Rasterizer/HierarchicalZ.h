@@ -0,0 +1,62 @@
+#ifndef __HIERARCHICAL_Z_H__
+#define __HIERARCHICAL_Z_H__
+
+#include <vector>
+
+#include "Vector.h"
+
+/*****************************************************************************/
+/* Conservative depth bounds of a depth buffer, per 8x8 block and per 64x64  */
+/* tile. Larger depth is closer, so a fragment below the minimum of its      */
+/* block can never pass the depth test. Coordinates follow the rasterizer,   */
+/* with y pointing up.                                                       */
+/*****************************************************************************/
+class HierarchicalZ {
+public:
+	static const unsigned int BlockSize = 8;
+	static const unsigned int TileSize = 64;
+
+	struct Bounds {
+		float minDepth;
+		float maxDepth;
+	};
+
+private:
+	uvec2 size;
+	uvec2 blockCount;
+	uvec2 tileCount;
+	std::vector<Bounds> blocks;
+	std::vector<Bounds> tiles;
+	bool valid;
+
+	void updateTile(unsigned int tileX, unsigned int tileY);
+
+public:
+	HierarchicalZ();
+
+	/*************************************************************************/
+	/* Matches the depth buffer size. The bounds are invalid until the next  */
+	/* clear().                                                              */
+	/*************************************************************************/
+	void resize(const uvec2& newSize);
+
+	void clear(float depth);
+
+	void invalidate();
+
+	bool isValid() const;
+
+	const uvec2& getSize() const;
+
+	const Bounds& getBlock(unsigned int blockX, unsigned int blockY) const;
+
+	const Bounds& getTile(unsigned int tileX, unsigned int tileY) const;
+
+	/*************************************************************************/
+	/* Recomputes the bounds of a block from the EPF_DEPTH buffer data, then */
+	/* the bounds of its tile.                                               */
+	/*************************************************************************/
+	void updateBlock(unsigned int blockX, unsigned int blockY, const float* depth);
+};
+
+#endif // __HIERARCHICAL_Z_H__
@@ -0,0 +1,59 @@
+#include <math.h>
+
+#include "Light.h"
+
+Light::Light() {
+	type = ELT_POINT;
+	ambientColor = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	difuseColor = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+	specularColor = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+	position = vec3(0.0f, 0.0f, 0.0f);
+	direction = vec3(0.0f,-1.0f, 0.0f);
+	range = 10.0f;
+	spotCutoff = 0.8f;
+}
+
+vec3 Light::evaluate(const vec3& surfacePosition, const vec3& normal, const vec3& eyePosition, const vec3& albedo, const vec4& material) const {
+	const vec3 ambient = vec3(ambientColor.x, ambientColor.y, ambientColor.z) * albedo;
+
+	vec3 toLight = -direction;
+	float attenuation = 1.0f;
+
+	if (type != ELT_DIRECTIONAL) {
+		toLight = position - surfacePosition;
+		const float distance = sqrtf(toLight.dot(toLight));
+		if ((distance >= range) || (distance == 0.0f)) {
+			return ambient;
+		}
+		toLight = toLight * (1.0f / distance);
+
+		// Smooth fall off, reaches zero exactly at range
+		attenuation = 1.0f - distance / range;
+		attenuation *= attenuation;
+
+		if (type == ELT_SPOT) {
+			const float cone = -toLight.dot(direction);
+			if (cone <= spotCutoff) {
+				return ambient;
+			}
+			attenuation *= (cone - spotCutoff) / (1.0f - spotCutoff);
+		}
+	}
+
+	const float diffuse = normal.dot(toLight);
+	if (diffuse <= 0.0f) {
+		return ambient;
+	}
+
+	vec3 color = vec3(difuseColor.x, difuseColor.y, difuseColor.z) * albedo * diffuse;
+
+	// Specular intensity in x, shininess / 256 in y
+	if (material.x > 0.0f) {
+		vec3 halfVector = (eyePosition - surfacePosition).normalize() + toLight;
+		halfVector.normalize();
+		const float specular = powf(fmaxf(normal.dot(halfVector), 0.0f), 1.0f + material.y * 255.0f) * material.x;
+		color += vec3(specularColor.x, specularColor.y, specularColor.z) * specular;
+	}
+
+	return ambient + color * attenuation;
+}
@@ -17,6 +17,20 @@ struct Light {
 	vec4 specularColor;
 	vec3 position;
 	vec3 direction;
+
+	// Point and spot lights fade out to nothing at range
+	float range;
+
+	// Cosine of the half angle of a spot cone
+	float spotCutoff;
+
+	Light();
+
+	/*************************************************************************/
+	/* Blinn-Phong reflection of this light off a surface point. direction   */
+	/* has to be normalized, material is PixelShaderData::material.          */
+	/*************************************************************************/
+	vec3 evaluate(const vec3& surfacePosition, const vec3& normal, const vec3& eyePosition, const vec3& albedo, const vec4& material) const;
 };
 
-#endif // __LIGHT_H__
\ No newline at end of file
+#endif // __LIGHT_H__
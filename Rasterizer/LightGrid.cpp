@@ -0,0 +1,195 @@
+#include <math.h>
+
+#include "LightGrid.h"
+
+static const unsigned int TileBlocks = LightGrid::TileSize / HierarchicalZ::BlockSize;
+
+LightGrid::LightGrid() {
+	lights = NULL;
+}
+
+void LightGrid::resize(const uvec2& newSize) {
+	if (size == newSize) {
+		return;
+	}
+
+	size = newSize;
+	tileCount = uvec2((size.x + TileSize - 1) / TileSize, (size.y + TileSize - 1) / TileSize);
+	tileLights.clear();
+	tileLights.resize(tileCount.x * tileCount.y);
+	tileBounds.resize(tileCount.x * tileCount.y);
+}
+
+const uvec2& LightGrid::getSize() const {
+	return size;
+}
+
+const uvec2& LightGrid::getTileCount() const {
+	return tileCount;
+}
+
+void LightGrid::build(const Light* newLights, unsigned int lightCount, const mat4& viewProjection, const vec4& viewport, const HierarchicalZ* depthBounds) {
+	lights = newLights;
+	globalLights.clear();
+	for (unsigned int index = 0; index < tileLights.size(); ++index) {
+		tileLights[index].clear();
+	}
+
+	// Bounds only line up with the tiles on a buffer of the same size
+	if ((depthBounds != NULL) && ((depthBounds->isValid() == false) || (depthBounds->getSize() != size))) {
+		depthBounds = NULL;
+	}
+	if (depthBounds != NULL) {
+		updateTileBounds(*depthBounds);
+	}
+
+	mat4 viewportTransformation;
+	viewportTransformation.setViewport(viewport.x, viewport.y, viewport.z, viewport.w);
+
+	for (unsigned int index = 0; index < lightCount; ++index) {
+		if (lights[index].type == Light::ELT_DIRECTIONAL) {
+			globalLights.push_back(index);
+		} else {
+			addLight(index, viewProjection, viewportTransformation, depthBounds != NULL);
+		}
+	}
+}
+
+void LightGrid::updateTileBounds(const HierarchicalZ& depthBounds) {
+	const unsigned int blockCountX = (size.x + HierarchicalZ::BlockSize - 1) / HierarchicalZ::BlockSize;
+	const unsigned int blockCountY = (size.y + HierarchicalZ::BlockSize - 1) / HierarchicalZ::BlockSize;
+
+	for (unsigned int tileY = 0; tileY < tileCount.y; ++tileY) {
+		for (unsigned int tileX = 0; tileX < tileCount.x; ++tileX) {
+			HierarchicalZ::Bounds bounds;
+			bounds.minDepth = 1.0f;
+			bounds.maxDepth = 0.0f;
+
+			for (unsigned int blockY = tileY * TileBlocks; (blockY < (tileY + 1) * TileBlocks) && (blockY < blockCountY); ++blockY) {
+				for (unsigned int blockX = tileX * TileBlocks; (blockX < (tileX + 1) * TileBlocks) && (blockX < blockCountX); ++blockX) {
+					const HierarchicalZ::Bounds& block = depthBounds.getBlock(blockX, blockY);
+					bounds.minDepth = fminf(bounds.minDepth, block.minDepth);
+					bounds.maxDepth = fmaxf(bounds.maxDepth, block.maxDepth);
+				}
+			}
+
+			tileBounds[tileY * tileCount.x + tileX] = bounds;
+		}
+	}
+}
+
+void LightGrid::addLight(unsigned int index, const mat4& viewProjection, const mat4& viewportTransformation, bool depthCulling) {
+	const Light& light = lights[index];
+
+	// Screen rectangle and depth range of the box around the light range
+	float minX = 1e30f;
+	float minY = 1e30f;
+	float maxX = -1e30f;
+	float maxY = -1e30f;
+	float minDepth = 1.0f;
+	float maxDepth = 0.0f;
+	bool clipped = false;
+	unsigned int frontCorners = 0;
+
+	for (unsigned int corner = 0; corner < 8; ++corner) {
+		const vec4 position(
+			light.position.x + ((corner & 1) ? light.range : -light.range),
+			light.position.y + ((corner & 2) ? light.range : -light.range),
+			light.position.z + ((corner & 4) ? light.range : -light.range),
+			1.0f);
+		const vec4 clip = viewProjection * position;
+
+		// Behind the near plane the projection flips, only the depth of the
+		// corners in front stays meaningful
+		if ((clip.z + clip.w < 0.0f) || (clip.w <= 0.0f)) {
+			clipped = true;
+			continue;
+		}
+
+		++frontCorners;
+		const float invW = 1.0f / clip.w;
+		const vec4 screen = viewportTransformation * vec4(clip.x * invW, clip.y * invW, clip.z * invW, 1.0f);
+		const float depth = 1.0f - screen.z;
+
+		minX = fminf(minX, screen.x);
+		minY = fminf(minY, screen.y);
+		maxX = fmaxf(maxX, screen.x);
+		maxY = fmaxf(maxY, screen.y);
+		minDepth = fminf(minDepth, depth);
+		maxDepth = fmaxf(maxDepth, depth);
+	}
+
+	// Entirely behind the camera, before the full screen rectangle hides it
+	if (frontCorners == 0) {
+		return;
+	}
+
+	// The farthest corner is in front whenever any is, so minDepth holds
+	if (clipped) {
+		minX = 0.0f;
+		minY = 0.0f;
+		maxX = (float)size.x;
+		maxY = (float)size.y;
+		maxDepth = 1.0f;
+	}
+
+	// Beyond the far plane
+	if ((minDepth > maxDepth) || (maxDepth < 0.0f)) {
+		return;
+	}
+
+	if ((maxX < 0.0f) || (maxY < 0.0f) || (minX >= (float)size.x) || (minY >= (float)size.y)) {
+		return;
+	}
+
+	const int tileMinX = (int)fmaxf(minX, 0.0f) / (int)TileSize;
+	const int tileMinY = (int)fmaxf(minY, 0.0f) / (int)TileSize;
+	const int tileMaxX = (int)fminf(maxX, (float)(size.x - 1)) / (int)TileSize;
+	const int tileMaxY = (int)fminf(maxY, (float)(size.y - 1)) / (int)TileSize;
+
+	for (int tileY = tileMinY; tileY <= tileMaxY; ++tileY) {
+		for (int tileX = tileMinX; tileX <= tileMaxX; ++tileX) {
+			const unsigned int tile = tileY * tileCount.x + tileX;
+
+			if (depthCulling && ((maxDepth < tileBounds[tile].minDepth) || (minDepth > tileBounds[tile].maxDepth))) {
+				continue;
+			}
+
+			tileLights[tile].push_back(index);
+		}
+	}
+}
+
+const Light& LightGrid::getLight(unsigned int index) const {
+	return lights[index];
+}
+
+const std::vector<unsigned int>& LightGrid::getGlobalLights() const {
+	return globalLights;
+}
+
+const std::vector<unsigned int>& LightGrid::getTileLights(int x, int y) const {
+	const int tileX = (x < 0) ? 0 : ((x >= (int)size.x) ? tileCount.x - 1 : x / TileSize);
+	const int tileY = (y < 0) ? 0 : ((y >= (int)size.y) ? tileCount.y - 1 : y / TileSize);
+
+	return tileLights[tileY * tileCount.x + tileX];
+}
+
+vec3 LightGrid::evaluate(int x, int y, const vec3& surfacePosition, const vec3& normal, const vec3& eyePosition, const vec3& albedo, const vec4& material) const {
+	vec3 color(0.0f, 0.0f, 0.0f);
+
+	for (unsigned int index = 0; index < globalLights.size(); ++index) {
+		color += lights[globalLights[index]].evaluate(surfacePosition, normal, eyePosition, albedo, material);
+	}
+
+	if (tileLights.empty()) {
+		return color;
+	}
+
+	const std::vector<unsigned int>& local = getTileLights(x, y);
+	for (unsigned int index = 0; index < local.size(); ++index) {
+		color += lights[local[index]].evaluate(surfacePosition, normal, eyePosition, albedo, material);
+	}
+
+	return color;
+}
@@ -0,0 +1,68 @@
+#ifndef __LIGHT_GRID_H__
+#define __LIGHT_GRID_H__
+
+#include <vector>
+
+#include "Vector.h"
+#include "Matrix4.h"
+#include "Light.h"
+#include "HierarchicalZ.h"
+
+/*****************************************************************************/
+/* Screen tiles with the point and spot lights that can reach them, rebuilt  */
+/* every frame. A light is added to a tile when the projected bounds of its  */
+/* range overlap the tile and its depth range overlaps the depth bounds of   */
+/* the tile. Directional lights reach every pixel and are kept apart. The    */
+/* ambient term of a light is lost outside its tiles. Coordinates follow     */
+/* the rasterizer, with y pointing up.                                       */
+/*****************************************************************************/
+class LightGrid {
+public:
+	// Multiple of HierarchicalZ::BlockSize
+	static const unsigned int TileSize = 32;
+
+private:
+	uvec2 size;
+	uvec2 tileCount;
+	const Light* lights;
+	std::vector<unsigned int> globalLights;
+	std::vector<std::vector<unsigned int> > tileLights;
+
+	// Depth bounds of every tile, from the HierarchicalZ blocks it covers
+	std::vector<HierarchicalZ::Bounds> tileBounds;
+
+	void updateTileBounds(const HierarchicalZ& depthBounds);
+	void addLight(unsigned int index, const mat4& viewProjection, const mat4& viewportTransformation, bool depthCulling);
+
+public:
+	LightGrid();
+
+	void resize(const uvec2& newSize);
+
+	const uvec2& getSize() const;
+
+	const uvec2& getTileCount() const;
+
+	/*************************************************************************/
+	/* Assigns lights to tiles. lights has to stay alive until the next      */
+	/* build. depthBounds may be NULL, tiles are then only culled in screen  */
+	/* space. When given, it has to hold the final opaque depth of the frame */
+	/* already, as left by a depth pre-pass, or lights in front of later     */
+	/* geometry would be dropped.                                            */
+	/*************************************************************************/
+	void build(const Light* lights, unsigned int lightCount, const mat4& viewProjection, const vec4& viewport, const HierarchicalZ* depthBounds);
+
+	const Light& getLight(unsigned int index) const;
+
+	const std::vector<unsigned int>& getGlobalLights() const;
+
+	const std::vector<unsigned int>& getTileLights(int x, int y) const;
+
+	/*************************************************************************/
+	/* Sums Light::evaluate over the directional lights and the lights of    */
+	/* the tile holding pixel (x, y).                                        */
+	/*************************************************************************/
+	vec3 evaluate(int x, int y, const vec3& surfacePosition, const vec3& normal, const vec3& eyePosition, const vec3& albedo, const vec4& material) const;
+};
+
+#endif // __LIGHT_GRID_H__
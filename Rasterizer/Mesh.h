@@ -3,6 +3,10 @@
 
 #include "CubeMesh.h"
 #include "Renderer.h"
+#include "CommandBuffer.h"
+#include "Frustum.h"
+#include "MeshSimplifier.h"
+#include "ObjLoader.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,7 +15,10 @@
 
 struct ShaderUniform {
 	mat4 modelViewProjectionMatrix;
+	mat4 modelMatrix;
+	mat4 normalMatrix;
 	vec4 ambientLight;
+	vec4 material;
 };
 
 struct Mesh {
@@ -22,14 +29,46 @@ struct Mesh {
 	const Vertex* vertices;
 	unsigned int vertexCount;
 	std::vector<Vertex> vertexBuffer;
+
+	// Triangles of vertexBuffer, which is drawn indexed when there are any
+	std::vector<unsigned int> indexBuffer;
 	
 	mat4 model;
 
+	// Of model, only kept by updateTransformation()
+	mat4 normalMatrix;
+
 	vec3 position;
 	vec3 rotation;
 	vec3 scale;
 
 	bool alphaBlend;
+
+	// PixelShaderData::material of G-buffer draws
+	vec4 material;
+
+	// Model space bounds of the vertices, empty meshes have a negative radius
+	vec3 boxMinimum;
+	vec3 boxMaximum;
+	vec3 sphereCenter;
+	float sphereRadius;
+
+	// Vertices the bounds were computed from
+	const Vertex* boundsVertices;
+	unsigned int boundsVertexCount;
+
+	/*************************************************************************/
+	/* Coarser versions of the vertices. A level is drawn while the bounding */
+	/* sphere covers less than its screenSize of the viewport height, the    */
+	/* levels are kept from the finest to the coarsest. Bounds and culling   */
+	/* always use the full vertices.                                         */
+	/*************************************************************************/
+	struct Lod {
+		std::vector<Vertex> vertexBuffer;
+		std::vector<unsigned int> indexBuffer;
+		float screenSize;
+	};
+	std::vector<Lod> lods;
 	
 	Mesh() {
 		texture = NULL;
@@ -37,13 +76,23 @@ struct Mesh {
 		vertexCount = 0;
 		shader = NULL;
 
+		boxMinimum = vec3(0.0f, 0.0f, 0.0f);
+		boxMaximum = vec3(0.0f, 0.0f, 0.0f);
+		sphereCenter = vec3(0.0f, 0.0f, 0.0f);
+		sphereRadius = -1.0f;
+		boundsVertices = NULL;
+		boundsVertexCount = 0;
+
 		model.setIdentity();
+		normalMatrix.setIdentity();
 
 		position = vec3( 0.0f, 0.0f, 0.0f);
 		rotation = vec3( 0.0f, 0.0f, 0.0f);
 		scale    = vec3( 1.0f, 1.0f, 1.0f);
 
 		alphaBlend = false;
+
+		material = vec4(0.5f, 0.125f, 0.0f, 0.0f);
 		
 	}
 
@@ -55,9 +104,27 @@ struct Mesh {
 		rotation.z = 0.0f;
 	}
 
+	// Updates model and normalMatrix from position, rotation and scale
+	void updateTransformation() {
+		model.setTransformation(position, rotation, scale);
+		normalMatrix = model.getInverse().GetTranspose();
+	}
+
 	void draw(Renderer* renderer) {
-		if ((vertices == NULL) || (vertexCount == 0)) {
-		//	return;
+		draw(renderer, camera->viewProjection, camera->frustum);
+	}
+
+	// Same draw from another point of view, like a ShadowMap pass
+	void draw(Renderer* renderer, const mat4& viewProjection) {
+		draw(renderer, viewProjection, Frustum(viewProjection));
+	}
+
+	void draw(Renderer* renderer, const mat4& viewProjection, const Frustum& frustum) {
+		model.setTransformation(position, rotation, scale);
+
+		// Nothing reaches the renderer, not even the state, when the mesh is off screen
+		if (!isVisible(frustum)) {
+			return;
 		}
 		
 		renderer->setActiveTexture(0, texture);
@@ -66,110 +133,284 @@ struct Mesh {
 		renderer->setFlag(Renderer::ERF_DEPTH_MASK, true);
 		renderer->setFlag(Renderer::ERF_ALPHA_BLEND, alphaBlend);
 
-		model.setTransformation(position, rotation, scale);
-
 		ShaderUniform uniform;
-		uniform.modelViewProjectionMatrix = camera->viewProjection * model;
+		uniform.modelViewProjectionMatrix = viewProjection * model;
+		uniform.modelMatrix = model;
+		uniform.normalMatrix = model.getInverse().GetTranspose();
+		uniform.material = material;
 		shader->uniform = &uniform;
 		
 		renderer->setShader(shader);
 
-		if (vertices != NULL) {
-			renderer->render(Renderer::EPT_TRIANGLES, vertices, vertexCount);
+		const Vertex* levelVertices;
+		unsigned int levelVertexCount;
+		const unsigned int* levelIndices;
+		unsigned int levelIndexCount;
+		getLodVertices(selectLod(viewProjection), levelVertices, levelVertexCount, levelIndices, levelIndexCount);
+		if (levelIndices != NULL) {
+			renderer->render(Renderer::EPT_TRIANGLES, levelVertices, levelVertexCount, levelIndices, levelIndexCount);
+		} else {
+			renderer->render(Renderer::EPT_TRIANGLES, levelVertices, levelVertexCount);
+		}
+	}
+
+	// Same draw recorded for Renderer::submit(), the uniform is copied
+	void draw(CommandBuffer* commands) {
+		draw(commands, camera->viewProjection, camera->frustum);
+	}
+
+	void draw(CommandBuffer* commands, const mat4& viewProjection) {
+		draw(commands, viewProjection, Frustum(viewProjection));
+	}
+
+	void draw(CommandBuffer* commands, const mat4& viewProjection, const Frustum& frustum) {
+		model.setTransformation(position, rotation, scale);
+
+		if (!isVisible(frustum)) {
+			return;
+		}
+
+		record(commands, viewProjection, model.getInverse().GetTranspose());
+	}
+
+	// Records a draw with model as it is, without culling
+	void record(CommandBuffer* commands, const mat4& viewProjection, const mat4& normalMatrix) const {
+		commands->setActiveTexture(0, texture);
+
+		commands->setFlag(Renderer::ERF_DEPTH_TEST, true);
+		commands->setFlag(Renderer::ERF_DEPTH_MASK, true);
+		commands->setFlag(Renderer::ERF_ALPHA_BLEND, alphaBlend);
+
+		ShaderUniform uniform;
+		uniform.modelViewProjectionMatrix = viewProjection * model;
+		uniform.modelMatrix = model;
+		uniform.normalMatrix = normalMatrix;
+		uniform.material = material;
+		commands->setUniform(&uniform, sizeof(uniform));
+		commands->setShader(shader);
+
+		// Clip w of the origin, the distance along the view direction
+		commands->setDepth((viewProjection * vec4(model[12], model[13], model[14], 1.0f)).w);
+
+		const Vertex* levelVertices;
+		unsigned int levelVertexCount;
+		const unsigned int* levelIndices;
+		unsigned int levelIndexCount;
+		getLodVertices(selectLod(viewProjection), levelVertices, levelVertexCount, levelIndices, levelIndexCount);
+		if (levelIndices != NULL) {
+			commands->render(Renderer::EPT_TRIANGLES, levelVertices, levelVertexCount, levelIndices, levelIndexCount);
+		} else {
+			commands->render(Renderer::EPT_TRIANGLES, levelVertices, levelVertexCount);
+		}
+	}
+
+	// Level 0 is the full vertices, level n is lods[n - 1], levelIndices is NULL for unindexed ones
+	void getLodVertices(unsigned int level, const Vertex*& levelVertices, unsigned int& levelVertexCount, const unsigned int*& levelIndices, unsigned int& levelIndexCount) const {
+		levelIndices = NULL;
+		levelIndexCount = 0;
+		if (level > 0) {
+			levelVertices = lods[level - 1].vertexBuffer.data();
+			levelVertexCount = lods[level - 1].vertexBuffer.size();
+			levelIndices = lods[level - 1].indexBuffer.data();
+			levelIndexCount = lods[level - 1].indexBuffer.size();
+		} else if (vertices != NULL) {
+			levelVertices = vertices;
+			levelVertexCount = vertexCount;
 		} else {
-			renderer->render(Renderer::EPT_TRIANGLES, &vertexBuffer[0], vertexBuffer.size());
+			levelVertices = vertexBuffer.data();
+			levelVertexCount = vertexBuffer.size();
+			if (!indexBuffer.empty()) {
+				levelIndices = indexBuffer.data();
+				levelIndexCount = indexBuffer.size();
+			}
+		}
+	}
+
+	/*************************************************************************/
+	/* Picks the level from the size of the bounding sphere on screen, its   */
+	/* radius scaled by the vertical projection, over clip w of its center   */
+	/* for perspective projections. Orthographic ones, like the directional  */
+	/* light ShadowMap, keep w at 1 and sizes do not change with distance.   */
+	/* The full vertices are used when the camera is inside of the sphere.   */
+	/*************************************************************************/
+	unsigned int selectLod(const mat4& viewProjection) const {
+		if (lods.empty() || (sphereRadius < 0.0f)) {
+			return 0;
+		}
+
+		const float radius = sphereRadius * getScale();
+		const vec3 row(viewProjection[1], viewProjection[5], viewProjection[9]);
+		float screenSize = radius * sqrtf(row.dot(row));
+
+		// Clip w only depends on the position when the last row is not (0, 0, 0, w)
+		const bool affine = (viewProjection[3] == 0.0f) && (viewProjection[7] == 0.0f) && (viewProjection[11] == 0.0f);
+		if (!affine) {
+			const vec3 center = model * sphereCenter;
+			const float w = (viewProjection * vec4(center.x, center.y, center.z, 1.0f)).w;
+			if (w <= radius) {
+				return 0;
+			}
+			screenSize /= w;
+		}
+
+		unsigned int level = 0;
+		while ((level < lods.size()) && (screenSize < lods[level].screenSize)) {
+			++level;
 		}
+		return level;
+	}
+
+	// Keeps the levels ordered from the largest screen size to the smallest
+	void addLod(const Lod& lod) {
+		unsigned int index = 0;
+		while ((index < lods.size()) && (lods[index].screenSize > lod.screenSize)) {
+			++index;
+		}
+		lods.insert(lods.begin() + index, lod);
+	}
+
+	// Adds a level from another OBJ file
+	int loadLod(const char* filename, float screenSize) {
+		Lod lod;
+		lod.screenSize = screenSize;
+		if (loadObj(filename, lod.vertexBuffer, lod.indexBuffer) != 0) {
+			return 1;
+		}
+
+		addLod(lod);
+		return 0;
+	}
+
+	// Adds a level simplified from the full vertices down to triangleRatio of their triangles
+	void generateLod(float triangleRatio, float screenSize) {
+		const Vertex* sourceVertices;
+		unsigned int sourceVertexCount;
+		const unsigned int* sourceIndices;
+		unsigned int sourceIndexCount;
+		getLodVertices(0, sourceVertices, sourceVertexCount, sourceIndices, sourceIndexCount);
+		const unsigned int triangleCount = ((sourceIndices != NULL) ? sourceIndexCount : sourceVertexCount) / 3;
+
+		Lod lod;
+		lod.screenSize = screenSize;
+		SimplifyTriangles(sourceVertices, sourceVertexCount, sourceIndices, sourceIndexCount, (unsigned int)(triangleCount * triangleRatio), lod.vertexBuffer, lod.indexBuffer);
+
+		addLod(lod);
+	}
+	
+	/*************************************************************************/
+	/* Recomputes the bounds of the vertices. Draws only do it on their own  */
+	/* when the vertex array or its size changes, vertices edited in place   */
+	/* need an explicit call.                                                */
+	/*************************************************************************/
+	void computeBounds() {
+		boundsVertices = (vertices != NULL) ? vertices : vertexBuffer.data();
+		boundsVertexCount = (vertices != NULL) ? vertexCount : vertexBuffer.size();
+
+		if ((boundsVertices == NULL) || (boundsVertexCount == 0)) {
+			boxMinimum = vec3(0.0f, 0.0f, 0.0f);
+			boxMaximum = vec3(0.0f, 0.0f, 0.0f);
+			sphereCenter = vec3(0.0f, 0.0f, 0.0f);
+			sphereRadius = -1.0f;
+			return;
+		}
+
+		boxMinimum = boundsVertices[0].position;
+		boxMaximum = boundsVertices[0].position;
+		for (unsigned int index = 1; index < boundsVertexCount; ++index) {
+			const vec3& position = boundsVertices[index].position;
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				boxMinimum[axis] = fminf(boxMinimum[axis], position[axis]);
+				boxMaximum[axis] = fmaxf(boxMaximum[axis], position[axis]);
+			}
+		}
+
+		// Around the box center, not the smallest sphere but found without any search
+		sphereCenter = (boxMinimum + boxMaximum) * 0.5f;
+		float radiusSquared = 0.0f;
+		for (unsigned int index = 0; index < boundsVertexCount; ++index) {
+			const vec3 offset = boundsVertices[index].position - sphereCenter;
+			radiusSquared = fmaxf(radiusSquared, offset.dot(offset));
+		}
+		sphereRadius = sqrtf(radiusSquared);
+	}
+
+	// Recomputes the bounds when the vertices changed, false for empty meshes
+	bool updateBounds() {
+		const Vertex* currentVertices = (vertices != NULL) ? vertices : vertexBuffer.data();
+		const unsigned int currentVertexCount = (vertices != NULL) ? vertexCount : vertexBuffer.size();
+		if ((currentVertices != boundsVertices) || (currentVertexCount != boundsVertexCount)) {
+			computeBounds();
+		}
+
+		return sphereRadius >= 0.0f;
+	}
+
+	// Rotations keep lengths, so the longest axis of the model matrix scales the radius
+	float getScale() const {
+		float scaleSquared = 0.0f;
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			const vec3 column(model[axis * 4 + 0], model[axis * 4 + 1], model[axis * 4 + 2]);
+			scaleSquared = fmaxf(scaleSquared, column.dot(column));
+		}
+		return sqrtf(scaleSquared);
+	}
+
+	// World box around the model box moved by the current model matrix
+	void getWorldBox(vec3& minimum, vec3& maximum) const {
+		const vec3 boxCenter = model * ((boxMinimum + boxMaximum) * 0.5f);
+		const vec3 boxHalfSize = (boxMaximum - boxMinimum) * 0.5f;
+		vec3 worldHalfSize;
+		for (unsigned int row = 0; row < 3; ++row) {
+			worldHalfSize[row] = fabsf(model[row]) * boxHalfSize.x + fabsf(model[4 + row]) * boxHalfSize.y + fabsf(model[8 + row]) * boxHalfSize.z;
+		}
+
+		minimum = boxCenter - worldHalfSize;
+		maximum = boxCenter + worldHalfSize;
+	}
+
+	/*************************************************************************/
+	/* Tests the bounds, moved by the current model matrix, against the      */
+	/* planes. The sphere rejects most meshes, the box catches the long and  */
+	/* thin ones the sphere overestimates.                                   */
+	/*************************************************************************/
+	bool isVisible(const Frustum& frustum) {
+		if (!updateBounds()) {
+			return false;
+		}
+
+		if (frustum.isSphereOutside(model * sphereCenter, sphereRadius * getScale())) {
+			return false;
+		}
+
+		vec3 minimum;
+		vec3 maximum;
+		getWorldBox(minimum, maximum);
+
+		return !frustum.isBoxOutside(minimum, maximum);
 	}
 	
+	// Replaces vertexBuffer and indexBuffer, so older unindexed triangles do not hide behind the new indices
 	int loadObj(const char* filename) {
-		FILE* file = fopen(filename, "r");
-		if (file == NULL) {
-			printf("Mesh::load(%s): Failed to open file.\n", filename);
+		vertexBuffer.clear();
+		indexBuffer.clear();
+		if (loadObj(filename, vertexBuffer, indexBuffer) != 0) {
 			return 1;
 		}
+
+		computeBounds();
 		
-		char line[256];
-		char objectName[64];
-		bool switchVertexOrder = true;
-		std::vector<vec3> positions;
-		std::vector<vec3> normals;
-		std::vector<vec2> uvs;
-		
-		vec3 tmp3;
-		
-		int indices[9];
-		
-		while (fgets(line, sizeof(line), file) != NULL) {
-			if (sscanf(line, "o %s", objectName) == 1) {
-				printf("Found object name: %s\n", objectName);
-			} else if (sscanf(line, "v %f %f %f", &tmp3.x, &tmp3.y, &tmp3.z) == 3) {
-				positions.push_back(tmp3);
-			} else if (sscanf(line, "vn %f %f %f", &tmp3.x, &tmp3.y, &tmp3.z) == 3) {
-				normals.push_back(tmp3);
-			} else if (sscanf(line, "vt %f %f", &tmp3.x, &tmp3.y) == 2) {
-				uvs.push_back(vec2(tmp3.x, tmp3.y));
-			} else if (sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d", 
-								&indices[0], &indices[1], &indices[2],
-								&indices[3], &indices[4], &indices[5],
-								&indices[6], &indices[7], &indices[8]) == 9) {
-				Vertex vertex;
-				vertex.color = vec4(1.0f, 1.0f, 1.0f, 1.0f);
-				
-				for (unsigned int index = 0; index < 9; ++index) {
-					indices[index] -= 1;
-				}
-				
-				if ((indices[0] >= positions.size()) || (indices[3] >= positions.size()) || (indices[6] >= positions.size())) {
-					printf("Mesh::load(%s): Found an out of bounds position index\n", filename);
-					continue;
-				}
-				if ((indices[1] >= uvs.size()) || (indices[4] >= uvs.size()) || (indices[7] >= uvs.size())) {
-					printf("Mesh::load(%s): Found an out of bounds uv index\n", filename);
-					continue;
-				}
-				if ((indices[2] >= normals.size()) || (indices[5] >= normals.size()) || (indices[8] >= normals.size())) {
-					printf("Mesh::load(%s): Found an out of bounds normal index\n", filename);
-					continue;
-				}
-
-				
-				if (switchVertexOrder) {
-					vertex.position = positions[indices[3]];
-					vertex.textureCoords = uvs[indices[4]];
-					vertex.normal = normals[indices[5]];
-					vertexBuffer.push_back(vertex);
-					
-					vertex.position = positions[indices[0]];
-					vertex.textureCoords = uvs[indices[1]];
-					vertex.normal = normals[indices[2]];
-					vertexBuffer.push_back(vertex);
-					
-					vertex.position = positions[indices[6]];
-					vertex.textureCoords = uvs[indices[7]];
-					vertex.normal = normals[indices[8]];
-					vertexBuffer.push_back(vertex);
-				} else {
-					vertex.position = positions[indices[0]];
-					vertex.textureCoords = uvs[indices[1]];
-					vertex.normal = normals[indices[2]];
-					vertexBuffer.push_back(vertex);
-					
-					vertex.position = positions[indices[3]];
-					vertex.textureCoords = uvs[indices[4]];
-					vertex.normal = normals[indices[5]];
-					vertexBuffer.push_back(vertex);
-					
-					vertex.position = positions[indices[6]];
-					vertex.textureCoords = uvs[indices[7]];
-					vertex.normal = normals[indices[8]];
-					vertexBuffer.push_back(vertex);
-				}
-			}
+		return 0;
+	}
+
+	// Appends the triangles of the file to buffer and bufferIndices
+	int loadObj(const char* filename, std::vector<Vertex>& buffer, std::vector<unsigned int>& bufferIndices) const {
+		const bool switchVertexOrder = true;
+		if (!LoadObj(filename, switchVertexOrder, buffer, bufferIndices)) {
+			printf("Mesh::load(%s): Failed to open file.\n", filename);
+			return 1;
 		}
 		
-		printf("Mesh::load(%s): Loaded %lu vertices\n", filename, vertexBuffer.size());
-		
-		fclose(file);
+		printf("Mesh::load(%s): Loaded %lu vertices, %lu indices\n", filename, buffer.size(), bufferIndices.size());
 		
 		return 0;
 	}
@@ -0,0 +1,379 @@
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+
+#include "MeshSimplifier.h"
+
+// Planes along open borders weigh this much more than the surface, so borders stay in place
+static const double BoundaryWeight = 100.0;
+
+// Symmetric 4x4 matrix summing the squared distances to a set of planes
+struct Quadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	Quadric()
+		: a2(0.0), ab(0.0), ac(0.0), ad(0.0), b2(0.0), bc(0.0), bd(0.0), c2(0.0), cd(0.0), d2(0.0) {
+	}
+
+	void addPlane(const vec3& normal, float distance, double weight) {
+		const double a = normal.x;
+		const double b = normal.y;
+		const double c = normal.z;
+		const double d = distance;
+		a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+		b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+		c2 += weight * c * c; cd += weight * c * d;
+		d2 += weight * d * d;
+	}
+
+	void add(const Quadric& other) {
+		a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+		b2 += other.b2; bc += other.bc; bd += other.bd;
+		c2 += other.c2; cd += other.cd;
+		d2 += other.d2;
+	}
+
+	double evaluate(const vec3& position) const {
+		const double x = position.x;
+		const double y = position.y;
+		const double z = position.z;
+		return a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x +
+			b2 * y * y + 2.0 * bc * y * z + 2.0 * bd * y +
+			c2 * z * z + 2.0 * cd * z +
+			d2;
+	}
+};
+
+// Orders vertex indices by position, so equal positions end up next to each other
+struct PositionLess {
+	const Vertex* vertices;
+
+	bool operator () (unsigned int a, unsigned int b) const {
+		const vec3& positionA = vertices[a].position;
+		const vec3& positionB = vertices[b].position;
+		if (positionA.x != positionB.x) {
+			return positionA.x < positionB.x;
+		}
+		if (positionA.y != positionB.y) {
+			return positionA.y < positionB.y;
+		}
+		return positionA.z < positionB.z;
+	}
+};
+
+// Source vertex not used by the result yet
+static const unsigned int Unused = 0xffffffff;
+
+static inline uint64_t edgeKey(unsigned int from, unsigned int to) {
+	return ((uint64_t)from << 32) | to;
+}
+
+class EdgeCollapser {
+	std::vector<vec3> positions;
+	std::vector<Quadric> quadrics;
+
+	// Vertex a collapsed vertex went into, itself for live ones
+	std::vector<unsigned int> remap;
+
+	// Three vertices per triangle, and the triangles of every vertex, dead ones included
+	std::vector<unsigned int> triangleVertices;
+	std::vector<bool> triangleAlive;
+	std::vector< std::vector<unsigned int> > vertexTriangles;
+
+	// Cheapest collapse first, half edges as from << 32 | to
+	typedef std::pair<double, uint64_t> Candidate;
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+
+	std::vector<unsigned int> fromNeighbors;
+	std::vector<unsigned int> toNeighbors;
+
+	unsigned int find(unsigned int vertex) {
+		unsigned int root = vertex;
+		while (remap[root] != root) {
+			root = remap[root];
+		}
+		while (remap[vertex] != root) {
+			const unsigned int next = remap[vertex];
+			remap[vertex] = root;
+			vertex = next;
+		}
+		return root;
+	}
+
+	bool contains(unsigned int triangle, unsigned int vertex) const {
+		const unsigned int* corner = &triangleVertices[triangle * 3];
+		return (corner[0] == vertex) || (corner[1] == vertex) || (corner[2] == vertex);
+	}
+
+	double getCost(unsigned int from, unsigned int to) const {
+		Quadric quadric = quadrics[from];
+		quadric.add(quadrics[to]);
+		return quadric.evaluate(positions[to]);
+	}
+
+	void addCandidates(unsigned int a, unsigned int b) {
+		candidates.push(Candidate(getCost(a, b), edgeKey(a, b)));
+		candidates.push(Candidate(getCost(b, a), edgeKey(b, a)));
+	}
+
+	void gatherNeighbors(unsigned int vertex, std::vector<unsigned int>& neighbors) const {
+		neighbors.clear();
+		const std::vector<unsigned int>& triangles = vertexTriangles[vertex];
+		for (unsigned int index = 0; index < triangles.size(); ++index) {
+			if (!triangleAlive[triangles[index]]) {
+				continue;
+			}
+			for (unsigned int corner = 0; corner < 3; ++corner) {
+				const unsigned int neighbor = triangleVertices[triangles[index] * 3 + corner];
+				if (neighbor != vertex) {
+					neighbors.push_back(neighbor);
+				}
+			}
+		}
+		std::sort(neighbors.begin(), neighbors.end());
+		neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+	}
+
+	/*************************************************************************/
+	/* A collapse is refused when from and to share no live triangle, when a */
+	/* remaining triangle around from would flip or become degenerate, or    */
+	/* when the two ends share more neighbors than triangles, which would    */
+	/* fold the surface onto itself.                                         */
+	/*************************************************************************/
+	bool canCollapse(unsigned int from, unsigned int to) {
+		const std::vector<unsigned int>& triangles = vertexTriangles[from];
+		unsigned int sharedTriangles = 0;
+		for (unsigned int index = 0; index < triangles.size(); ++index) {
+			const unsigned int triangle = triangles[index];
+			if (!triangleAlive[triangle]) {
+				continue;
+			}
+			if (contains(triangle, to)) {
+				++sharedTriangles;
+				continue;
+			}
+
+			vec3 before[3];
+			vec3 after[3];
+			for (unsigned int corner = 0; corner < 3; ++corner) {
+				const unsigned int vertex = triangleVertices[triangle * 3 + corner];
+				before[corner] = positions[vertex];
+				after[corner] = (vertex == from) ? positions[to] : positions[vertex];
+			}
+			const vec3 normalBefore = (before[1] - before[0]).cross(before[2] - before[0]);
+			const vec3 normalAfter = (after[1] - after[0]).cross(after[2] - after[0]);
+			if (normalBefore.dot(normalAfter) <= 0.0f) {
+				return false;
+			}
+		}
+
+		// Candidates remapped by earlier collapses may no longer be an edge at all
+		if (sharedTriangles == 0) {
+			return false;
+		}
+
+		gatherNeighbors(from, fromNeighbors);
+		gatherNeighbors(to, toNeighbors);
+		unsigned int sharedNeighbors = 0;
+		for (unsigned int a = 0, b = 0; (a < fromNeighbors.size()) && (b < toNeighbors.size()); ) {
+			if (fromNeighbors[a] < toNeighbors[b]) {
+				++a;
+			} else if (toNeighbors[b] < fromNeighbors[a]) {
+				++b;
+			} else {
+				++sharedNeighbors;
+				++a;
+				++b;
+			}
+		}
+
+		return sharedNeighbors <= sharedTriangles;
+	}
+
+	// Moves from onto to, returns the number of triangles that disappeared
+	unsigned int collapse(unsigned int from, unsigned int to) {
+		unsigned int removed = 0;
+		const std::vector<unsigned int>& triangles = vertexTriangles[from];
+		for (unsigned int index = 0; index < triangles.size(); ++index) {
+			const unsigned int triangle = triangles[index];
+			if (!triangleAlive[triangle]) {
+				continue;
+			}
+			if (contains(triangle, to)) {
+				triangleAlive[triangle] = false;
+				++removed;
+				continue;
+			}
+			for (unsigned int corner = 0; corner < 3; ++corner) {
+				if (triangleVertices[triangle * 3 + corner] == from) {
+					triangleVertices[triangle * 3 + corner] = to;
+				}
+			}
+			vertexTriangles[to].push_back(triangle);
+		}
+
+		quadrics[to].add(quadrics[from]);
+		remap[from] = to;
+		vertexTriangles[from].clear();
+
+		// The edges around to changed cost
+		gatherNeighbors(to, toNeighbors);
+		for (unsigned int index = 0; index < toNeighbors.size(); ++index) {
+			addCandidates(to, toNeighbors[index]);
+		}
+
+		return removed;
+	}
+
+public:
+	void simplify(const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount, unsigned int targetTriangleCount, std::vector<Vertex>& resultVertices, std::vector<unsigned int>& resultIndices) {
+		const unsigned int triangleCount = ((indices != NULL) ? indexCount : vertexCount) / 3;
+		const unsigned int cornerCount = triangleCount * 3;
+
+		// Vertices sharing a position become one
+		std::vector<unsigned int> order(vertexCount);
+		for (unsigned int index = 0; index < vertexCount; ++index) {
+			order[index] = index;
+		}
+		PositionLess less;
+		less.vertices = vertices;
+		std::sort(order.begin(), order.end(), less);
+
+		std::vector<unsigned int> welded(vertexCount);
+		for (unsigned int index = 0; index < vertexCount; ++index) {
+			if ((index == 0) || less(order[index - 1], order[index])) {
+				positions.push_back(vertices[order[index]].position);
+			}
+			welded[order[index]] = positions.size() - 1;
+		}
+
+		triangleVertices.resize(cornerCount);
+		for (unsigned int corner = 0; corner < cornerCount; ++corner) {
+			triangleVertices[corner] = welded[(indices != NULL) ? indices[corner] : corner];
+		}
+
+		const unsigned int positionCount = positions.size();
+		quadrics.resize(positionCount);
+		remap.resize(positionCount);
+		for (unsigned int index = 0; index < positionCount; ++index) {
+			remap[index] = index;
+		}
+		vertexTriangles.resize(positionCount);
+		triangleAlive.assign(triangleCount, true);
+
+		// Planes of the triangles, weighted by area
+		std::vector<uint64_t> edges;
+		unsigned int aliveCount = 0;
+		for (unsigned int triangle = 0; triangle < triangleCount; ++triangle) {
+			const unsigned int* corner = &triangleVertices[triangle * 3];
+			if ((corner[0] == corner[1]) || (corner[1] == corner[2]) || (corner[0] == corner[2])) {
+				triangleAlive[triangle] = false;
+				continue;
+			}
+			++aliveCount;
+
+			vec3 normal = (positions[corner[1]] - positions[corner[0]]).cross(positions[corner[2]] - positions[corner[0]]);
+			const float length = sqrtf(normal.dot(normal));
+			if (length > 0.0f) {
+				normal *= 1.0f / length;
+			}
+
+			for (unsigned int index = 0; index < 3; ++index) {
+				const unsigned int a = corner[index];
+				const unsigned int b = corner[(index + 1) % 3];
+				quadrics[a].addPlane(normal, -normal.dot(positions[corner[0]]), 0.5 * length);
+				vertexTriangles[a].push_back(triangle);
+				edges.push_back(edgeKey((a < b) ? a : b, (a < b) ? b : a));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+
+		// Edges used by a single triangle are borders, a plane through them keeps them from moving
+		for (unsigned int triangle = 0; triangle < triangleCount; ++triangle) {
+			if (!triangleAlive[triangle]) {
+				continue;
+			}
+
+			const unsigned int* corner = &triangleVertices[triangle * 3];
+			const vec3 normal = (positions[corner[1]] - positions[corner[0]]).cross(positions[corner[2]] - positions[corner[0]]);
+			for (unsigned int index = 0; index < 3; ++index) {
+				const unsigned int a = corner[index];
+				const unsigned int b = corner[(index + 1) % 3];
+				const uint64_t key = edgeKey((a < b) ? a : b, (a < b) ? b : a);
+				const std::pair<std::vector<uint64_t>::iterator, std::vector<uint64_t>::iterator> range = std::equal_range(edges.begin(), edges.end(), key);
+				if (range.second - range.first != 1) {
+					continue;
+				}
+
+				const vec3 edge = positions[b] - positions[a];
+				vec3 borderNormal = edge.cross(normal);
+				const float length = sqrtf(borderNormal.dot(borderNormal));
+				if (length == 0.0f) {
+					continue;
+				}
+				borderNormal *= 1.0f / length;
+
+				const double weight = BoundaryWeight * edge.dot(edge);
+				quadrics[a].addPlane(borderNormal, -borderNormal.dot(positions[a]), weight);
+				quadrics[b].addPlane(borderNormal, -borderNormal.dot(positions[a]), weight);
+			}
+		}
+
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+		for (unsigned int index = 0; index < edges.size(); ++index) {
+			addCandidates(edges[index] >> 32, edges[index] & 0xffffffff);
+		}
+
+		while ((aliveCount > targetTriangleCount) && !candidates.empty()) {
+			const Candidate candidate = candidates.top();
+			candidates.pop();
+
+			const unsigned int from = find(candidate.second >> 32);
+			const unsigned int to = find(candidate.second & 0xffffffff);
+			if (from == to) {
+				continue;
+			}
+
+			// Costs only grow, stale candidates go back with their current one
+			const double cost = getCost(from, to);
+			if (cost > candidate.first) {
+				candidates.push(Candidate(cost, edgeKey(from, to)));
+				continue;
+			}
+
+			if (!canCollapse(from, to)) {
+				continue;
+			}
+
+			aliveCount -= collapse(from, to);
+		}
+
+		// Corners of the same source vertex moved together, so they still share one
+		std::vector<unsigned int> resultVertex(vertexCount, Unused);
+		resultVertices.clear();
+		resultIndices.clear();
+		resultIndices.reserve(aliveCount * 3);
+		for (unsigned int triangle = 0; triangle < triangleCount; ++triangle) {
+			if (!triangleAlive[triangle]) {
+				continue;
+			}
+			for (unsigned int corner = triangle * 3; corner < triangle * 3 + 3; ++corner) {
+				const unsigned int source = (indices != NULL) ? indices[corner] : corner;
+				if (resultVertex[source] == Unused) {
+					resultVertex[source] = resultVertices.size();
+					resultVertices.push_back(vertices[source]);
+					resultVertices.back().position = positions[triangleVertices[corner]];
+				}
+				resultIndices.push_back(resultVertex[source]);
+			}
+		}
+	}
+};
+
+void SimplifyTriangles(const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount, unsigned int targetTriangleCount, std::vector<Vertex>& resultVertices, std::vector<unsigned int>& resultIndices) {
+	EdgeCollapser collapser;
+	collapser.simplify(vertices, vertexCount, indices, indexCount, targetTriangleCount, resultVertices, resultIndices);
+}
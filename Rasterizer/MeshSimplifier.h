@@ -0,0 +1,21 @@
+#ifndef __MESH_SIMPLIFIER_H__
+#define __MESH_SIMPLIFIER_H__
+
+#include <vector>
+
+#include "Vertex.h"
+
+/*****************************************************************************/
+/* Edge collapse simplification of a triangle list, indexed, or three        */
+/* vertices per triangle when indices is NULL. Vertices sharing a position   */
+/* are treated as one, the edge with the least quadric error is collapsed    */
+/* into one of its ends until targetTriangleCount triangles are left. Every  */
+/* position of the result is one of the source, and vertices keep their      */
+/* normal, uv and color, so the result stays inside the bounds of the        */
+/* source. Collapses that would flip a triangle are skipped, so the result   */
+/* may keep more triangles than asked. The result is always indexed, with    */
+/* only the vertices still in use.                                           */
+/*****************************************************************************/
+void SimplifyTriangles(const Vertex* vertices, unsigned int vertexCount, const unsigned int* indices, unsigned int indexCount, unsigned int targetTriangleCount, std::vector<Vertex>& resultVertices, std::vector<unsigned int>& resultIndices);
+
+#endif // __MESH_SIMPLIFIER_H__
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#if defined (_WIN32)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "ObjLoader.h"
+
+// Every power of ten a double holds exactly
+static const double PowersOfTen[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+static const int MaxPowerOfTen = 22;
+
+// Digits past this many do not change a float, only the exponent
+static const int MaxSignificantDigits = 19;
+
+// Integers stop growing past this, so overlong indices end up out of bounds instead of wrapping around
+static const int MaxInteger = (INT_MAX - 9) / 10;
+
+// Float exponents past this are infinity or 0 anyway
+static const int MaxExponent = 1000;
+
+// uv or normal index of corners without one
+static const int MissingIndex = -1;
+
+// End of the vertex list of a position
+static const unsigned int NoVertex = 0xffffffff;
+
+/*****************************************************************************/
+/* Read only view of a whole file. It is mapped where the platform allows    */
+/* it, so the pages are read by the parser as it goes and never copied.      */
+/*****************************************************************************/
+class FileView {
+	const char* data;
+	size_t size;
+
+#if defined (_WIN32)
+	std::vector<char> buffer;
+#else
+	void* mapping;
+#endif
+
+public:
+	FileView()
+		: data(NULL), size(0) {
+#if !defined (_WIN32)
+		mapping = MAP_FAILED;
+#endif
+	}
+
+	~FileView() {
+#if !defined (_WIN32)
+		if (mapping != MAP_FAILED) {
+			munmap(mapping, size);
+		}
+#endif
+	}
+
+	bool open(const char* filename) {
+#if defined (_WIN32)
+		FILE* file = fopen(filename, "rb");
+		if (file == NULL) {
+			return false;
+		}
+
+		fseek(file, 0, SEEK_END);
+		const long length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if (length < 0) {
+			fclose(file);
+			return false;
+		}
+
+		buffer.resize(length);
+		const bool result = (length == 0) || (fread(&buffer[0], 1, length, file) == (size_t)length);
+		fclose(file);
+
+		data = buffer.empty() ? NULL : &buffer[0];
+		size = buffer.size();
+		return result;
+#else
+		const int file = ::open(filename, O_RDONLY);
+		if (file < 0) {
+			return false;
+		}
+
+		struct stat status;
+		if (fstat(file, &status) != 0) {
+			close(file);
+			return false;
+		}
+
+		size = status.st_size;
+		if (size > 0) {
+			mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+		}
+		close(file);
+
+		if (size == 0) {
+			return true;
+		}
+		if (mapping == MAP_FAILED) {
+			size = 0;
+			return false;
+		}
+
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		data = (const char*)mapping;
+		return true;
+#endif
+	}
+
+	const char* begin() const {
+		return data;
+	}
+
+	const char* end() const {
+		return data + size;
+	}
+};
+
+// Position, uv and normal of a face corner, starting at 0
+struct ObjCorner {
+	int position;
+	int uv;
+	int normal;
+
+	bool operator == (const ObjCorner& other) const {
+		return (position == other.position) && (uv == other.uv) && (normal == other.normal);
+	}
+};
+
+class ObjParser {
+	const char* filename;
+	bool switchVertexOrder;
+
+	const char* cursor;
+	const char* end;
+
+	std::vector<vec3> positions;
+	std::vector<vec3> normals;
+	std::vector<vec2> uvs;
+
+	std::vector<Vertex>& vertices;
+	std::vector<unsigned int>& indices;
+	unsigned int firstVertex;
+
+	/*************************************************************************/
+	/* Vertices made by this file, listed per position. The position index   */
+	/* is the hash, so a lookup only compares the uv and normal of the few   */
+	/* vertices sharing that position.                                       */
+	/*************************************************************************/
+	std::vector<unsigned int> positionVertices;
+	std::vector<unsigned int> nextVertices;
+	std::vector<ObjCorner> vertexCorners;
+
+	// Corners of the current face, and their vertices
+	std::vector<ObjCorner> faceCorners;
+	std::vector<unsigned int> faceVertices;
+
+	// Vertices that sum up the normals of their faces
+	std::vector<unsigned int> smoothVertices;
+
+	static bool isDigit(char character) {
+		return (character >= '0') && (character <= '9');
+	}
+
+	bool isLineEnd() const {
+		return (cursor == end) || (*cursor == '\n') || (*cursor == '\r');
+	}
+
+	void skipSpaces() {
+		while ((cursor != end) && ((*cursor == ' ') || (*cursor == '\t'))) {
+			++cursor;
+		}
+	}
+
+	void skipLine() {
+		const char* lineEnd = (const char*)memchr(cursor, '\n', end - cursor);
+		cursor = (lineEnd != NULL) ? lineEnd + 1 : end;
+	}
+
+	bool parseInteger(int& value) {
+		bool negative = false;
+		if ((cursor != end) && ((*cursor == '-') || (*cursor == '+'))) {
+			negative = (*cursor == '-');
+			++cursor;
+		}
+		if ((cursor == end) || !isDigit(*cursor)) {
+			return false;
+		}
+
+		value = 0;
+		while ((cursor != end) && isDigit(*cursor)) {
+			value = (value <= MaxInteger) ? value * 10 + (*cursor - '0') : INT_MAX;
+			++cursor;
+		}
+		if (negative) {
+			value = -value;
+		}
+		return true;
+	}
+
+	/*************************************************************************/
+	/* Decimal digits into an integer mantissa, then a single multiply or    */
+	/* divide by an exact power of ten. Not locale aware, OBJ files always   */
+	/* use a point.                                                          */
+	/*************************************************************************/
+	bool parseFloat(float& value) {
+		skipSpaces();
+		const char* start = cursor;
+
+		bool negative = false;
+		if ((cursor != end) && ((*cursor == '-') || (*cursor == '+'))) {
+			negative = (*cursor == '-');
+			++cursor;
+		}
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		int significantDigits = 0;
+		bool anyDigits = false;
+		while ((cursor != end) && isDigit(*cursor)) {
+			if (significantDigits < MaxSignificantDigits) {
+				mantissa = mantissa * 10 + (*cursor - '0');
+				significantDigits += (mantissa != 0) ? 1 : 0;
+			} else {
+				++exponent;
+			}
+			anyDigits = true;
+			++cursor;
+		}
+		if ((cursor != end) && (*cursor == '.')) {
+			++cursor;
+			while ((cursor != end) && isDigit(*cursor)) {
+				if (significantDigits < MaxSignificantDigits) {
+					mantissa = mantissa * 10 + (*cursor - '0');
+					significantDigits += (mantissa != 0) ? 1 : 0;
+					--exponent;
+				}
+				anyDigits = true;
+				++cursor;
+			}
+		}
+		if (!anyDigits) {
+			cursor = start;
+			return false;
+		}
+
+		if ((cursor != end) && ((*cursor == 'e') || (*cursor == 'E'))) {
+			const char* exponentStart = cursor;
+			++cursor;
+			int exponentValue;
+			if (parseInteger(exponentValue)) {
+				exponent += (exponentValue > MaxExponent) ? MaxExponent : ((exponentValue < -MaxExponent) ? -MaxExponent : exponentValue);
+			} else {
+				cursor = exponentStart;
+			}
+		}
+
+		double result = (double)mantissa;
+		if (mantissa != 0) {
+			while (exponent > MaxPowerOfTen) {
+				result *= PowersOfTen[MaxPowerOfTen];
+				exponent -= MaxPowerOfTen;
+			}
+			while (exponent < -MaxPowerOfTen) {
+				result /= PowersOfTen[MaxPowerOfTen];
+				exponent += MaxPowerOfTen;
+			}
+			result = (exponent >= 0) ? result * PowersOfTen[exponent] : result / PowersOfTen[-exponent];
+		}
+
+		value = (float)(negative ? -result : result);
+		return true;
+	}
+
+	// 1 is the first element, -1 the last one read so far. Invalid ones end up at count
+	static int resolveIndex(int value, unsigned int count) {
+		const int index = (value > 0) ? value - 1 : (int)count + value;
+		return (index >= 0) ? index : (int)count;
+	}
+
+	bool parseCorner(ObjCorner& corner) {
+		skipSpaces();
+		int value;
+		if (!parseInteger(value)) {
+			return false;
+		}
+
+		corner.position = resolveIndex(value, positions.size());
+		corner.uv = MissingIndex;
+		corner.normal = MissingIndex;
+
+		if ((cursor == end) || (*cursor != '/')) {
+			return true;
+		}
+		++cursor;
+		if (parseInteger(value)) {
+			corner.uv = resolveIndex(value, uvs.size());
+		}
+
+		if ((cursor == end) || (*cursor != '/')) {
+			return true;
+		}
+		++cursor;
+		if (parseInteger(value)) {
+			corner.normal = resolveIndex(value, normals.size());
+		}
+
+		return true;
+	}
+
+	bool isValid(const ObjCorner& corner) const {
+		if ((corner.position < 0) || (corner.position >= (int)positions.size())) {
+			printf("Mesh::load(%s): Found an out of bounds position index\n", filename);
+			return false;
+		}
+		if ((corner.uv != MissingIndex) && (corner.uv >= (int)uvs.size())) {
+			printf("Mesh::load(%s): Found an out of bounds uv index\n", filename);
+			return false;
+		}
+		if ((corner.normal != MissingIndex) && (corner.normal >= (int)normals.size())) {
+			printf("Mesh::load(%s): Found an out of bounds normal index\n", filename);
+			return false;
+		}
+		return true;
+	}
+
+	unsigned int getVertex(const ObjCorner& corner) {
+		for (unsigned int vertex = positionVertices[corner.position]; vertex != NoVertex; vertex = nextVertices[vertex]) {
+			if (vertexCorners[vertex] == corner) {
+				return firstVertex + vertex;
+			}
+		}
+
+		nextVertices.push_back(positionVertices[corner.position]);
+		positionVertices[corner.position] = vertexCorners.size();
+		vertexCorners.push_back(corner);
+
+		Vertex vertex;
+		vertex.position = positions[corner.position];
+		vertex.textureCoords = (corner.uv != MissingIndex) ? uvs[corner.uv] : vec2(0.0f, 0.0f);
+		vertex.normal = (corner.normal != MissingIndex) ? normals[corner.normal] : vec3(0.0f, 0.0f, 0.0f);
+		vertex.color = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+		vertices.push_back(vertex);
+
+		if (corner.normal == MissingIndex) {
+			smoothVertices.push_back(vertices.size() - 1);
+		}
+		return vertices.size() - 1;
+	}
+
+	void parseFace() {
+		faceCorners.clear();
+		ObjCorner corner;
+		while (parseCorner(corner)) {
+			if (!isValid(corner)) {
+				return;
+			}
+			faceCorners.push_back(corner);
+		}
+		if (faceCorners.size() < 3) {
+			return;
+		}
+
+		// Vertices in the order the triangles use them first
+		faceVertices.resize(faceCorners.size());
+		for (unsigned int index = 0; index < faceCorners.size(); ++index) {
+			const unsigned int corner = (switchVertexOrder && (index < 2)) ? 1 - index : index;
+			faceVertices[corner] = getVertex(faceCorners[corner]);
+		}
+
+		// A fan around the first corner, the first two corners of every triangle swap places to switch the order
+		for (unsigned int index = 2; index < faceVertices.size(); ++index) {
+			const unsigned int a = faceVertices[0];
+			const unsigned int b = faceVertices[index - 1];
+			const unsigned int c = faceVertices[index];
+			indices.push_back(switchVertexOrder ? b : a);
+			indices.push_back(switchVertexOrder ? a : b);
+			indices.push_back(c);
+
+			// Area weighted, so small triangles of a fan count less
+			const vec3 normal = (vertices[b].position - vertices[a].position).cross(vertices[c].position - vertices[a].position);
+			if (faceCorners[0].normal == MissingIndex) {
+				vertices[a].normal += normal;
+			}
+			if (faceCorners[index - 1].normal == MissingIndex) {
+				vertices[b].normal += normal;
+			}
+			if (faceCorners[index].normal == MissingIndex) {
+				vertices[c].normal += normal;
+			}
+		}
+	}
+
+	void parseVector(std::vector<vec3>& vectors) {
+		vec3 vector;
+		if (parseFloat(vector.x) && parseFloat(vector.y) && parseFloat(vector.z)) {
+			vectors.push_back(vector);
+		}
+	}
+
+	// Lines by their first characters, so every array gets its size once
+	void reserve() {
+		unsigned int positionCount = 0;
+		unsigned int normalCount = 0;
+		unsigned int uvCount = 0;
+		unsigned int faceCount = 0;
+
+		for (const char* line = cursor; line < end; ) {
+			if ((line[0] == 'v') && (line + 1 < end)) {
+				positionCount += ((line[1] == ' ') || (line[1] == '\t')) ? 1 : 0;
+				normalCount += (line[1] == 'n') ? 1 : 0;
+				uvCount += (line[1] == 't') ? 1 : 0;
+			} else if (line[0] == 'f') {
+				++faceCount;
+			}
+
+			const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+			line = (lineEnd != NULL) ? lineEnd + 1 : end;
+		}
+
+		positions.reserve(positionCount);
+		normals.reserve(normalCount);
+		uvs.reserve(uvCount);
+
+		// Triangles, and a vertex per position as for smooth meshes
+		indices.reserve(indices.size() + faceCount * 3);
+		vertices.reserve(vertices.size() + positionCount);
+		positionVertices.reserve(positionCount);
+		nextVertices.reserve(positionCount);
+		vertexCorners.reserve(positionCount);
+	}
+
+public:
+	ObjParser(const char* nfilename, bool nswitchVertexOrder, std::vector<Vertex>& nvertices, std::vector<unsigned int>& nindices)
+		: filename(nfilename), switchVertexOrder(nswitchVertexOrder), cursor(NULL), end(NULL), vertices(nvertices), indices(nindices), firstVertex(nvertices.size()) {
+	}
+
+	void parse(const char* begin, const char* nend) {
+		cursor = begin;
+		end = nend;
+
+		reserve();
+
+		while (cursor != end) {
+			skipSpaces();
+			if (isLineEnd()) {
+				skipLine();
+				continue;
+			}
+
+			const char type = *cursor++;
+			const char subtype = (cursor != end) ? *cursor : '\n';
+			if (type == 'v') {
+				if ((subtype == ' ') || (subtype == '\t')) {
+					parseVector(positions);
+					positionVertices.resize(positions.size(), NoVertex);
+				} else if (subtype == 'n') {
+					++cursor;
+					parseVector(normals);
+				} else if (subtype == 't') {
+					++cursor;
+					vec2 uv;
+					if (parseFloat(uv.x) && parseFloat(uv.y)) {
+						uvs.push_back(uv);
+					}
+				}
+			} else if ((type == 'f') && ((subtype == ' ') || (subtype == '\t'))) {
+				parseFace();
+			} else if ((type == 'o') && ((subtype == ' ') || (subtype == '\t'))) {
+				skipSpaces();
+				const char* name = cursor;
+				while (!isLineEnd() && (*cursor != ' ') && (*cursor != '\t')) {
+					++cursor;
+				}
+				printf("Found object name: %.*s\n", (int)(cursor - name), name);
+			}
+
+			skipLine();
+		}
+
+		for (unsigned int index = 0; index < smoothVertices.size(); ++index) {
+			vec3& normal = vertices[smoothVertices[index]].normal;
+			const float length = sqrtf(normal.dot(normal));
+			if (length > 0.0f) {
+				normal *= 1.0f / length;
+			}
+		}
+	}
+};
+
+bool LoadObj(const char* filename, bool switchVertexOrder, std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+	FileView file;
+	if (!file.open(filename)) {
+		return false;
+	}
+
+	ObjParser parser(filename, switchVertexOrder, vertices, indices);
+	parser.parse(file.begin(), file.end());
+
+	return true;
+}
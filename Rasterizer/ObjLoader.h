@@ -0,0 +1,20 @@
+#ifndef __OBJ_LOADER_H__
+#define __OBJ_LOADER_H__
+
+#include <vector>
+
+#include "Vertex.h"
+
+/*****************************************************************************/
+/* Reads the faces of a Wavefront OBJ file as triangles, appended to         */
+/* vertices and indices. The file is mapped and parsed in a single pass,     */
+/* after a line count sizes the arrays. Faces with more than three corners   */
+/* are split into fans, corners can be v, v/vt, v//vn or v/vt/vn, and        */
+/* negative indices count back from the last element read. Corners with the  */
+/* same position, uv and normal share a single vertex, corners without a     */
+/* normal get the average normal of their faces. Returns false when the      */
+/* file can not be read.                                                     */
+/*****************************************************************************/
+bool LoadObj(const char* filename, bool switchVertexOrder, std::vector<Vertex>& vertices, std::vector<unsigned int>& indices);
+
+#endif // __OBJ_LOADER_H__
@@ -1,17 +1,42 @@
 #include <stdlib.h>
 
 #include "RenderTarget.h"
+#include "Image.h"
 
 RenderTarget::RenderTarget() {
 	for (unsigned int index = 0; index < RenderTarget::ERT_COUNT; ++index) {
 		buffers[index] = NULL;
 	}
+	sampleCount = 1;
 }
 
 void RenderTarget::setBuffer(const BufferType type, Image* buffer) {
 	buffers[type] = buffer;
+
+	if (type == ERT_DEPTH) {
+		hierarchicalZ.invalidate();
+	}
 }
 
 Image* RenderTarget::getBuffer(const BufferType type) const {
 	return buffers[type];
 }
+
+void RenderTarget::setSampleCount(unsigned int count) {
+	sampleCount = (count > 1) ? MaxSampleCount : 1;
+}
+
+unsigned int RenderTarget::getSampleCount() const {
+	return sampleCount;
+}
+
+void RenderTarget::clearDepth() {
+	Image* depth = buffers[ERT_DEPTH];
+	if (depth == NULL) {
+		return;
+	}
+
+	depth->clear();
+	hierarchicalZ.resize(depth->getSize());
+	hierarchicalZ.clear(0.0f);
+}
@@ -1,6 +1,9 @@
 #ifndef __RENDER_TARGET_H__
 #define __RENDER_TARGET_H__
 
+#include "HierarchicalZ.h"
+#include "FragmentBuffer.h"
+
 class Image;
 
 struct RenderTarget {
@@ -12,13 +15,35 @@ struct RenderTarget {
 		ERT_DEPTH,
 		ERT_COUNT
 	};
+	// Upper limit of the sample count, see setSampleCount()
+	static const unsigned int MaxSampleCount = 4;
+
 	Image* buffers[ERT_COUNT];
 
+	// Bounds of ERT_DEPTH, only kept up to date when cleared through clearDepth()
+	HierarchicalZ hierarchicalZ;
+
+	// Blended fragments waiting for Renderer::resolveTransparency()
+	FragmentBuffer fragmentBuffer;
+
+	unsigned int sampleCount;
+
 	RenderTarget();
 
 	void setBuffer(const BufferType type, Image* buffer);
 
 	Image* getBuffer(const BufferType type) const;
+
+	/*************************************************************************/
+	/* Samples per pixel, 1 or MaxSampleCount. The samples of a pixel are    */
+	/* stored side by side along x, so every buffer of a multisampled target */
+	/* is sampleCount times as wide as the image it resolves to.             */
+	/*************************************************************************/
+	void setSampleCount(unsigned int count);
+
+	unsigned int getSampleCount() const;
+
+	void clearDepth();
 };
 
 #endif //__RENDER_TARGET_H__
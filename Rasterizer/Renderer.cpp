@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+
+#include <algorithm>
 
 #include "Renderer.h"
+#include "SpanCoverage.h"
+#include "CommandBuffer.h"
 
 //https://github.com/ssloy/tinyrenderer/wiki/Lesson-2:-Triangle-rasterization-and-back-face-culling
 //https://github.com/joshb/linedrawing/blob/master/Rasterizer.cpp
@@ -17,11 +22,18 @@ inline T max(const T a, const T b) {
 }
 
 void Renderer::drawLine(const vec3& begin, const vec4& beginColor, const vec3& end, const vec4& endColor) {
+	// Lines always write color, a depth only target has no room for them
+	if (colorBufferPtr == NULL) {
+		return;
+	}
+
 	VertexShaderData vertex[2];
 	vertex[0].position = vec4(begin, 1.0f);
 	vertex[0].color = beginColor;
 	vertex[1].position = vec4(end, 1.0f);
 	vertex[1].color = endColor;
+	vertex[0].instance = activeInstance;
+	vertex[1].instance = activeInstance;
 
 	if (activeShader) {
 		for (unsigned int index = 0; index < 2; ++index) {
@@ -31,14 +43,24 @@ void Renderer::drawLine(const vec3& begin, const vec4& beginColor, const vec3& e
 		}
 	}
 
+	// Lines write depth through the Image interface, which the hierarchical Z does not follow
+	if ((hierarchicalZ != NULL) && renderFlags[ERF_DEPTH_MASK]) {
+		hierarchicalZ->invalidate();
+		hierarchicalZ = NULL;
+	}
+
 	float xdiff = (vertex[1].position.x - vertex[0].position.x);
 	float ydiff = (vertex[1].position.y - vertex[0].position.y);
 	float zdiff = (vertex[1].position.z - vertex[0].position.z);
 
-	const uvec2 size = colorBufferPtr->getSize();
+	// Lines cover every sample of their pixels
+	const uvec2 size = targetSize;
+	const unsigned int samples = sampleCount;
 
 	if(xdiff == 0.0f && ydiff == 0.0f) {
-		colorBufferPtr->setPixelf(vertex[0].position.x, vertex[0].position.y, beginColor);
+		for (unsigned int sample = 0; sample < samples; ++sample) {
+			colorBufferPtr->setPixelf((int)vertex[0].position.x * samples + sample, vertex[0].position.y, beginColor);
+		}
 		return;
 	}
 
@@ -69,14 +91,16 @@ void Renderer::drawLine(const vec3& begin, const vec4& beginColor, const vec3& e
 				continue;
 			}
 
-			if (renderFlags[ERF_DEPTH_TEST] && depth < depthBufferPtr->getPixelf(x, invY).x) {
+			if (renderFlags[ERF_DEPTH_TEST] && depth < depthBufferPtr->getPixelf((int)x * samples, invY).x) {
 				continue;
 			}
 
-			colorBufferPtr->setPixelf(x, invY, color);
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				colorBufferPtr->setPixelf((int)x * samples + sample, invY, color);
 
-			if (renderFlags[ERF_DEPTH_MASK]) {
-				depthBufferPtr->setPixelf(x, invY, vec4(depth, depth, depth, 1.0f));
+				if (renderFlags[ERF_DEPTH_MASK]) {
+					depthBufferPtr->setPixelf((int)x * samples + sample, invY, vec4(depth, depth, depth, 1.0f));
+				}
 			}
 		}
 	} else {
@@ -103,25 +127,21 @@ void Renderer::drawLine(const vec3& begin, const vec4& beginColor, const vec3& e
 				continue;
 			}
 
-			if (renderFlags[ERF_DEPTH_TEST] && depth < depthBufferPtr->getPixelf(x, invY).x) {
+			if (renderFlags[ERF_DEPTH_TEST] && depth < depthBufferPtr->getPixelf((int)x * samples, invY).x) {
 				continue;
 			}
 
-			colorBufferPtr->setPixelf(x, invY, color);
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				colorBufferPtr->setPixelf((int)x * samples + sample, invY, color);
 
-			if (renderFlags[ERF_DEPTH_MASK]) {
-				depthBufferPtr->setPixelf(x, invY, vec4(depth, depth, depth, 1.0f));
+				if (renderFlags[ERF_DEPTH_MASK]) {
+					depthBufferPtr->setPixelf((int)x * samples + sample, invY, vec4(depth, depth, depth, 1.0f));
+				}
 			}
 		}
 	}
 }
 
-//https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/rasterization-stage
-inline float edgeFunction(const vec4& a, const vec4& b, const vec4& c) {
-	//return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x); 
-	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
-}
-
 int min(int a, int b, int c, int d) {// printf("min(%d, %d, %d, %d)\n", a, b, c, d);
 	int ans = a;
 	if (b < ans) {
@@ -150,160 +170,1279 @@ inline int max(int a, int b, int c, int d) {// printf("max(%d, %d, %d, %d)\n", a
 	return ans;
 }
 
-//https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/rasterization-stage
-void Renderer::drawTriangle(const Vertex& v0, const Vertex& v1, const Vertex& v2) {
-	VertexShaderData vertex[3];
-	vertex[0].position = vec4(v0.position, 1.0f);
-	vertex[0].normal = vec4(v0.normal, 0.0f);
-	vertex[0].uv = v0.textureCoords;
-	vertex[0].color = v0.color;
-	vertex[0].index = 0;
-
-	vertex[2].position = vec4(v1.position, 1.0f);
-	vertex[2].normal = vec4(v1.normal, 0.0f);
-	vertex[2].uv = v1.textureCoords;
-	vertex[2].color = v1.color;
-	vertex[2].index = 1;
-
-	vertex[1].position = vec4(v2.position, 1.0f);
-	vertex[1].normal = vec4(v2.normal, 0.0f);
-	vertex[1].uv = v2.textureCoords;
-	vertex[1].color = v2.color;
-	vertex[1].index = 2;
-
-	float vz[3];
+// Guard band half size in NDC units. Triangles inside it are only clipped
+// against near and far, the rasterizer already walks just their on screen part
+static const float GuardBand = 4.0f;
+
+enum ClipPlane {
+	ECP_NEAR,
+	ECP_FAR,
+	ECP_LEFT,
+	ECP_RIGHT,
+	ECP_BOTTOM,
+	ECP_TOP,
+
+	ECP_COUNT
+};
+
+// Signed distance to a clip space plane, negative outside
+static inline float clipDistance(const vec4& position, unsigned int plane) {
+	switch (plane) {
+	case ECP_NEAR :
+		return position.z + position.w;
+	case ECP_FAR :
+		return position.w - position.z;
+	case ECP_LEFT :
+		return position.x + GuardBand * position.w;
+	case ECP_RIGHT :
+		return GuardBand * position.w - position.x;
+	case ECP_BOTTOM :
+		return position.y + GuardBand * position.w;
+	case ECP_TOP :
+		return GuardBand * position.w - position.y;
+	}
+	return 0.0f;
+}
 
-	if (activeShader) {
-		for (unsigned int index = 0; index < 3; ++index) {
-			if (activeShader->totalVaryingData != NULL) {
-				activeShader->varying = activeShader->totalVaryingData + index * activeShader->varyingCount;
+// One bit per plane the position is outside of
+static inline unsigned int computeClipCode(const vec4& position) {
+	unsigned int clipCode = 0;
+	for (unsigned int plane = 0; plane < ECP_COUNT; ++plane) {
+		if (clipDistance(position, plane) < 0.0f) {
+			clipCode |= 1 << plane;
+		}
+	}
+	return clipCode;
+}
+
+// Clip space attributes are linear, so every one of them is a plain lerp
+static inline VertexShaderData lerpVertex(const VertexShaderData& a, const VertexShaderData& b, float t, unsigned int varyingCount) {
+	VertexShaderData result;
+	result.position = a.position + (b.position - a.position) * t;
+	result.normal = a.normal + (b.normal - a.normal) * t;
+	result.color = a.color + (b.color - a.color) * t;
+	result.uv = a.uv + (b.uv - a.uv) * t;
+	for (unsigned int slot = 0; slot < varyingCount; ++slot) {
+		result.varying[slot] = a.varying[slot] + (b.varying[slot] - a.varying[slot]) * t;
+	}
+	result.index = a.index;
+	result.instance = a.instance;
+	return result;
+}
+
+void Renderer::processVertices(const Vertex* vertices, unsigned int vertexCount) {
+	if (vertexCache.size() < vertexCount) {
+		vertexCache.resize(vertexCount);
+	}
+
+	VertexBatch& batch = vertexBatch;
+	varyingCount = (activeShader != NULL) ? min(activeShader->varyingCount, MaxVaryingCount) : 0;
+
+	for (unsigned int first = 0; first < vertexCount; first += VertexBatchSize) {
+		batch.count = min(vertexCount - first, VertexBatchSize);
+
+		// Array of structures to structure of arrays
+		for (unsigned int index = 0; index < batch.count; ++index) {
+			const Vertex& source = vertices[first + index];
+			batch.position[0][index] = source.position.x;
+			batch.position[1][index] = source.position.y;
+			batch.position[2][index] = source.position.z;
+			batch.position[3][index] = 1.0f;
+			batch.normal[0][index] = source.normal.x;
+			batch.normal[1][index] = source.normal.y;
+			batch.normal[2][index] = source.normal.z;
+			batch.normal[3][index] = 0.0f;
+			batch.color[0][index] = source.color.x;
+			batch.color[1][index] = source.color.y;
+			batch.color[2][index] = source.color.z;
+			batch.color[3][index] = source.color.w;
+			batch.uv[0][index] = source.textureCoords.x;
+			batch.uv[1][index] = source.textureCoords.y;
+			batch.index[index] = first + index;
+		}
+		batch.instance = activeInstance;
+
+		// Varyings are outputs only
+		for (unsigned int slot = 0; slot < varyingCount; ++slot) {
+			for (unsigned int component = 0; component < 4; ++component) {
+				memset(batch.varying[slot][component], 0, batch.count * sizeof(float));
 			}
+		}
 
-			activeShader->vertexShader(vertex[index]);
+		if (activeShader) {
+			activeShader->vertexShaderBatch(batch);
+		}
+
+		// Normalize the display coordinates, clip space is kept for the clipper
+		float (*screen)[VertexBatchSize] = vertexBatchScreen;
+		for (unsigned int index = 0; index < batch.count; ++index) {
+			const float invW = 1.0f / batch.position[3][index];
+			screen[0][index] = batch.position[0][index] * invW;
+			screen[1][index] = batch.position[1][index] * invW;
+			screen[2][index] = batch.position[2][index] * invW;
+			screen[3][index] = 1.0f;
+		}
 
-			if (renderFlags[GFX_PERSPECTIVE_CORRECT]) {
-				vertex[index].uv /= vertex[index].position.z;
-				vz[index] = 1.0f / vertex[index].position.z;
+		// Scale the coordinates to the viewport size
+		TransformBatch(viewportTransformation, screen[0], screen[1], screen[2], screen[3], batch.count);
+
+		// And back, the rasterizer works on whole vertices
+		for (unsigned int index = 0; index < batch.count; ++index) {
+			TransformedVertex& transformed = vertexCache[first + index];
+			VertexShaderData& vertex = transformed.data;
+			vertex.position = vec4(batch.position[0][index], batch.position[1][index], batch.position[2][index], batch.position[3][index]);
+			vertex.normal = vec4(batch.normal[0][index], batch.normal[1][index], batch.normal[2][index], batch.normal[3][index]);
+			vertex.color = vec4(batch.color[0][index], batch.color[1][index], batch.color[2][index], batch.color[3][index]);
+			vertex.uv = vec2(batch.uv[0][index], batch.uv[1][index]);
+			vertex.index = batch.index[index];
+			vertex.instance = batch.instance;
+			for (unsigned int slot = 0; slot < varyingCount; ++slot) {
+				vertex.varying[slot] = vec4(batch.varying[slot][0][index], batch.varying[slot][1][index], batch.varying[slot][2][index], batch.varying[slot][3][index]);
 			}
+			transformed.screen = vec4(screen[0][index], screen[1][index], screen[2][index], 1.0f / batch.position[3][index]);
+			transformed.clipCode = computeClipCode(vertex.position);
+		}
+	}
+}
 
-			// Normalize the display coordinates
-			vertex[index].position /= vertex[index].position.w;
+vec4 Renderer::projectVertex(const vec4& position) const {
+	const float invW = 1.0f / position.w;
+	vec4 screen = viewportTransformation * vec4(position.x * invW, position.y * invW, position.z * invW, 1.0f);
+	screen.w = invW;
+	return screen;
+}
 
-			// Scale the coordinates to the viewport size
-			vertex[index].position = viewportTransformation * vertex[index].position;
+// Slack for the rounding of the depth bounds against the per pixel depth
+static const float HierarchicalZBias = 1.0f / 65536.0f;
+
+// Subpixel precision of the edge functions, vertices are snapped to 28.4 fixed point.
+// The guard band keeps snapped coordinates within 20 bits, so the edge functions
+// need 64 bits at setup but only their steps have to fit 32
+static const int SubpixelBits = 4;
+static const int SubpixelScale = 1 << SubpixelBits;
+
+// Rotated grid of a multisampled pixel, in subpixels from its center
+static const int SamplePosition[RenderTarget::MaxSampleCount][2] = {
+	{-2,-6}, { 6,-2}, {-6, 2}, { 2, 6}
+};
+
+// Largest distance of a sample from the pixel center along x or y, in subpixels
+static const int SampleReach = 6;
+
+//https://www.scratchapixel.com/lessons/3d-basic-rendering/rasterization-practical-implementation/rasterization-stage
+//https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
+bool Renderer::setupTriangle(const TransformedVertex& v0, const TransformedVertex& v1, const TransformedVertex& v2, Triangle& triangle) {
+	vec4* position = triangle.position;
+	position[0] = v0.screen;
+	position[1] = v2.screen;
+	position[2] = v1.screen;
+
+	// Everything after this, coverage and attribute planes, sees the snapped positions
+	int fixedX[3];
+	int fixedY[3];
+	for (unsigned int index = 0; index < 3; ++index) {
+		fixedX[index] = (int)floorf(position[index].x * SubpixelScale + 0.5f);
+		fixedY[index] = (int)floorf(position[index].y * SubpixelScale + 0.5f);
+		position[index].x = (float)fixedX[index] / SubpixelScale;
+		position[index].y = (float)fixedY[index] / SubpixelScale;
+	}
+
+	const int64_t area = (int64_t)(fixedX[1] - fixedX[0]) * (fixedY[2] - fixedY[0]) - (int64_t)(fixedY[1] - fixedY[0]) * (fixedX[2] - fixedX[0]);
+
+	if (area <= 0) {
+		return false;
+	}
+
+	triangle.area = (float)area / (SubpixelScale * SubpixelScale);
+
+	// Pixels whose center, or any of their samples, lies within the snapped bounds
+	const int half = SubpixelScale / 2;
+	const int low = half - 1 - ((sampleCount > 1) ? SampleReach : 0);
+	const int high = half - ((sampleCount > 1) ? SampleReach : 0);
+	const uvec2 size = targetSize;
+	triangle.minX = min((fixedX[0] + low) >> SubpixelBits, (fixedX[1] + low) >> SubpixelBits, (fixedX[2] + low) >> SubpixelBits, 0);
+	triangle.minY = min((fixedY[0] + low) >> SubpixelBits, (fixedY[1] + low) >> SubpixelBits, (fixedY[2] + low) >> SubpixelBits, 0);
+	triangle.maxX = max((fixedX[0] - high) >> SubpixelBits, (fixedX[1] - high) >> SubpixelBits, (fixedX[2] - high) >> SubpixelBits, (int)size.x - 1);
+	triangle.maxY = max((fixedY[0] - high) >> SubpixelBits, (fixedY[1] - high) >> SubpixelBits, (fixedY[2] - high) >> SubpixelBits, (int)size.y - 1);
+
+	if ((triangle.minX > triangle.maxX) || (triangle.minY > triangle.maxY)) {
+		return false;
+	}
+	triangle.instance = v0.data.instance;
+
+	// Edges 1 -> 2, 2 -> 0 and 0 -> 1, counter clockwise with the inside on their left
+	for (unsigned int edge = 0; edge < 3; ++edge) {
+		const unsigned int a = (edge + 1) % 3;
+		const unsigned int b = (edge + 2) % 3;
+		const int deltaX = fixedX[b] - fixedX[a];
+		const int deltaY = fixedY[b] - fixedY[a];
+
+		// Top-left fill rule, a pixel center exactly on a shared edge belongs to one triangle only
+		const bool topLeft = (deltaY < 0) || ((deltaY == 0) && (deltaX < 0));
+
+		triangle.edgeDx[edge] = -deltaY * SubpixelScale;
+		triangle.edgeDy[edge] = deltaX * SubpixelScale;
+		triangle.edgeOrigin[edge] = (int64_t)deltaX * (half - fixedY[a]) - (int64_t)deltaY * (half - fixedX[a]) - (topLeft ? 0 : 1);
+	}
+
+	triangle.maxDepth = 1.0f - min(min(position[0].z, position[1].z), position[2].z);
+
+	if (isOccluded(triangle)) {
+		return false;
+	}
+
+	setupPlanes(v0.data, v2.data, v1.data, triangle);
+	return true;
+}
+
+// Fits value = origin + dx * x + dy * y through the values a0, a1 and a2 at the three vertices
+static inline void fitPlane(float a0, float a1, float a2, const float deltaCol[3], const float deltaRow[3], const vec4& p0, float& origin, float& dx, float& dy) {
+	dx = a0 * deltaCol[0] + a1 * deltaCol[1] + a2 * deltaCol[2];
+	dy = a0 * deltaRow[0] + a1 * deltaRow[1] + a2 * deltaRow[2];
+
+	// Pixel centers are at half coordinates
+	origin = a0 - dx * (p0.x - 0.5f) - dy * (p0.y - 0.5f);
+}
+
+void Renderer::setupPlanes(const VertexShaderData& d0, const VertexShaderData& d1, const VertexShaderData& d2, Triangle& triangle) const {
+	const VertexShaderData* data[3] = {&d0, &d1, &d2};
+	const vec4* position = triangle.position;
+	const float invArea = 1.0f / triangle.area;
+
+	// Same steps as the edge functions, divided by the area
+	const float deltaCol[3] = {(position[1].y - position[2].y) * invArea, (position[2].y - position[0].y) * invArea, (position[0].y - position[1].y) * invArea};
+	const float deltaRow[3] = {(position[2].x - position[1].x) * invArea, (position[0].x - position[2].x) * invArea, (position[1].x - position[0].x) * invArea};
+
+	float value[3][EAP_COUNT];
+	for (unsigned int index = 0; index < 3; ++index) {
+		const float invW = position[index].w;
+		const float scale = renderFlags[GFX_PERSPECTIVE_CORRECT] ? invW : 1.0f;
+
+		value[index][EAP_DEPTH] = 1.0f - position[index].z;
+		value[index][EAP_INV_W] = invW;
+		for (unsigned int component = 0; component < 4; ++component) {
+			value[index][EAP_NORMAL + component] = data[index]->normal[component];
+			value[index][EAP_COLOR + component] = data[index]->color[component];
+		}
+		value[index][EAP_UV + 0] = data[index]->uv.x * scale;
+		value[index][EAP_UV + 1] = data[index]->uv.y * scale;
+		for (unsigned int component = 0; component < varyingCount * 4; ++component) {
+			value[index][EAP_VARYING + component] = data[index]->varying[component / 4][component % 4] * scale;
 		}
-	} 
+	}
 
-	const float area = edgeFunction(vertex[0].position, vertex[1].position, vertex[2].position);
+	// Depth always takes the same path, so a depth only pre-pass matches the later passes bit for bit
+	fitPlane(value[0][EAP_DEPTH], value[1][EAP_DEPTH], value[2][EAP_DEPTH], deltaCol, deltaRow, position[0],
+		triangle.planeOrigin[EAP_DEPTH], triangle.planeDx[EAP_DEPTH], triangle.planeDy[EAP_DEPTH]);
 
-	if (area <= 0.0f) {
+	// A depth only pass never reads more than the depth
+	if (renderFlags[ERF_DEPTH_ONLY]) {
 		return;
 	}
 
-	const uvec2 size = colorBufferPtr->getSize();
-	int minX = min(vertex[0].position.x, vertex[1].position.x, vertex[2].position.x, 0);if (minX < 0)minX = 0;
-	int minY = min((int)vertex[0].position.y, (int)vertex[1].position.y, (int)vertex[2].position.y, 0);if (minY < 0)minY = 0;
-	const int maxX = max(vertex[0].position.x, vertex[1].position.x, vertex[2].position.x, (int)size.x - 1);
-	const int maxY = max(vertex[0].position.y, vertex[1].position.y, vertex[2].position.y, (int)size.y - 1);
+	for (unsigned int plane = EAP_INV_W; plane < EAP_VARYING + varyingCount * 4; ++plane) {
+		fitPlane(value[0][plane], value[1][plane], value[2][plane], deltaCol, deltaRow, position[0],
+			triangle.planeOrigin[plane], triangle.planeDx[plane], triangle.planeDy[plane]);
+	}
+}
 
-	const vec4 p(minX + 0.5f, minY + 0.5f, 0.0f, 0.0f);
+bool Renderer::isOccluded(const Triangle& triangle) const {
+	if ((hierarchicalZ == NULL) || (renderFlags[ERF_DEPTH_TEST] == false)) {
+		return false;
+	}
 
-	vec3 deltaCol = {
-		vertex[1].position.y - vertex[2].position.y,
-		vertex[2].position.y - vertex[0].position.y,
-		vertex[0].position.y - vertex[1].position.y
-	};
-	vec3 deltaRow = {
-		vertex[2].position.x - vertex[1].position.x,
-		vertex[0].position.x - vertex[2].position.x,
-		vertex[1].position.x - vertex[0].position.x
-	};
-	vec3 row = {
-		edgeFunction(vertex[1].position, vertex[2].position, p),
-		edgeFunction(vertex[2].position, vertex[0].position, p),
-		edgeFunction(vertex[0].position, vertex[1].position, p)
-	};
+	// Occluded if it is behind the farthest stored depth of every tile it touches
+	for (int tileY = triangle.minY / TileSize; tileY <= triangle.maxY / TileSize; ++tileY) {
+		for (int tileX = triangle.minX / TileSize; tileX <= triangle.maxX / TileSize; ++tileX) {
+			if (triangle.maxDepth + HierarchicalZBias >= hierarchicalZ->getTile(tileX, tileY).minDepth) {
+				return false;
+			}
+		}
+	}
 
-	for (int y = minY; y <= maxY; ++y) {
-		vec3 col = row;
+	return true;
+}
 
-		for (int x = minX; x <= maxX; ++x) {
+// Returns -1 if the block lies outside of an edge, 1 if it is inside all three and 0 otherwise
+static inline int classifyBlock(const int64_t origin[3], const int deltaCol[3], const int deltaRow[3]) {
+	const int64_t extent = SpanWidth - 1;
+	int result = 1;
 
-			bool isInside = ((col.x >= 0.0f) && (col.y >= 0.0f) && (col.z >= 0.0f));
-			if (isInside) {
-				int invY = size.y - 1 - y;
+	for (unsigned int index = 0; index < 3; ++index) {
+		const int64_t stepX = deltaCol[index] * extent;
+		const int64_t stepY = deltaRow[index] * extent;
 
-				// Normalize weight
-				vec3 weight = col / area;
+		// The extremes of a linear function over a block are on its corners
+		if (origin[index] + max(stepX, (int64_t)0) + max(stepY, (int64_t)0) < 0) {
+			return -1;
+		}
+		if (origin[index] + min(stepX, (int64_t)0) + min(stepY, (int64_t)0) < 0) {
+			result = 0;
+		}
+	}
 
-				float perspectiveFix = 1.0f;
-				if (renderFlags[GFX_PERSPECTIVE_CORRECT]) {
-					perspectiveFix = 1.0f / (weight.x * vz[0] + weight.y * vz[1] + weight.z * vz[2]);
-				}
+	return result;
+}
+
+template <unsigned int Format>
+struct ColorPixelSize {
+	static const unsigned int value = (Format == Image::EPF_R8G8B8A8) ? 4 : 3;
+};
 
-				// Interpolate and invert depth
-				float depth = 1.0f;
-				for (uint32_t index = 0; index < 3; ++index) {
-					depth -= vertex[index].position.z * weight[index];
+// Same conversions as Image::getPixelf and Image::setPixelf
+template <unsigned int Format>
+static inline vec4 readColor(const uint8_t* pixel) {
+	const float alpha = (Format == Image::EPF_R8G8B8A8) ? (float)pixel[3] / 255.0f : 1.0f;
+	return vec4((float)pixel[2] / 255.0f, (float)pixel[1] / 255.0f, (float)pixel[0] / 255.0f, alpha);
+}
+
+template <unsigned int Format>
+static inline void writeColor(uint8_t* pixel, const vec4& color) {
+	pixel[0] = color.z * 255.0f;
+	pixel[1] = color.y * 255.0f;
+	pixel[2] = color.x * 255.0f;
+	if (Format == Image::EPF_R8G8B8A8) {
+		pixel[3] = color.w * 255.0f;
+	}
+}
+
+// Shades rows y and y + 1 as 2x2 quads. Lanes outside of the masks are still
+// interpolated, they are the helper pixels for the uv derivatives. Multisampled
+// pixels are shaded once at their center, depth and color go to every covered
+// sample that passes the depth test
+template <unsigned int ColorFormat, bool DepthTest, bool DepthMask, bool AlphaBlend, bool PerspectiveCorrect, bool DepthOnly, bool GBuffer, bool Multisample>
+void Renderer::shadeSpanT(const Triangle& triangle, const SpanCoverage* span, const unsigned int* mask, int x, int y) {
+	const float* planeDx = triangle.planeDx;
+	const int height = targetSize.y;
+	const unsigned int samples = Multisample ? RenderTarget::MaxSampleCount : 1;
+
+	// EPF_NONE goes through the virtual Image interface, everything else is written in place
+	const bool direct = (ColorFormat != Image::EPF_NONE);
+	const unsigned int pixelSize = ColorPixelSize<ColorFormat>::value;
+
+	// Pixels with at least one covered sample
+	unsigned int pixelMask[2] = {0, 0};
+	for (unsigned int row = 0; row < 2; ++row) {
+		for (unsigned int sample = 0; sample < samples; ++sample) {
+			pixelMask[row] |= mask[row * samples + sample];
+		}
+	}
+	const unsigned int quadMask = pixelMask[0] | pixelMask[1];
+
+	// Planes evaluated at the first pixel of both rows, every other pixel is a single step away
+	const unsigned int planeCount = DepthOnly ? 0 : EAP_VARYING + varyingCount * 4;
+	float rowValue[2][EAP_COUNT];
+	for (unsigned int plane = EAP_INV_W; plane < planeCount; ++plane) {
+		rowValue[0][plane] = triangle.planeOrigin[plane] + planeDx[plane] * x + triangle.planeDy[plane] * y;
+		rowValue[1][plane] = rowValue[0][plane] + triangle.planeDy[plane];
+	}
+
+	for (unsigned int quad = 0; quad < SpanWidth; quad += 2) {
+		if (((quadMask >> quad) & 3) == 0) {
+			continue;
+		}
+
+		// Perspective correct uv of the four pixels, covered or not
+		vec2 uv[2][2];
+		float perspectiveFix[2][2] = {{1.0f, 1.0f}, {1.0f, 1.0f}};
+		if (DepthOnly == false) {
+			for (unsigned int row = 0; row < 2; ++row) {
+				for (unsigned int column = 0; column < 2; ++column) {
+					const float lane = (float)(quad + column);
+
+					if (PerspectiveCorrect) {
+						perspectiveFix[row][column] = 1.0f / (rowValue[row][EAP_INV_W] + planeDx[EAP_INV_W] * lane);
+					}
+
+					uv[row][column] = vec2(
+						rowValue[row][EAP_UV + 0] + planeDx[EAP_UV + 0] * lane,
+						rowValue[row][EAP_UV + 1] + planeDx[EAP_UV + 1] * lane) * perspectiveFix[row][column];
 				}
+			}
+		}
+
+		// Coarse derivatives, shared by the whole quad
+		const vec2 uvDx = uv[0][1] - uv[0][0];
+		const vec2 uvDy = uv[1][0] - uv[0][0];
+
+		for (unsigned int row = 0; row < 2; ++row) {
+			unsigned int rowMask = (pixelMask[row] >> quad) & 3;
+			if (rowMask == 0) {
+				continue;
+			}
+
+			const int invY = height - 1 - (y + row);
+			uint8_t* colorRow = direct ? target.color + invY * target.colorStride : NULL;
+			float* depthRow = (direct && (DepthTest || DepthMask)) ? target.depth + invY * target.width : NULL;
+
+			while (rowMask != 0) {
+				const unsigned int column = __builtin_ctz(rowMask);
+				rowMask &= rowMask - 1;
+
+				const unsigned int lane = quad + column;
+				const int px = x + lane;
+
+				// Covered samples that pass the depth test
+				unsigned int sampleMask = 0;
+				float depth[RenderTarget::MaxSampleCount];
+				for (unsigned int sample = 0; sample < samples; ++sample) {
+					if (((mask[row * samples + sample] >> lane) & 1) == 0) {
+						continue;
+					}
+
+					depth[sample] = span[row * samples + sample].depth[lane];
 
-				if (depth < 0.0f || depth > 1.0f) {
-					goto LB_CONTINUE;
+					if (DepthTest) {
+						const int sx = px * samples + sample;
+						const float stored = direct ? depthRow[sx] : depthBufferPtr->getPixelf(sx, invY).x;
+						if (depth[sample] < stored) {
+							continue;
+						}
+					}
+
+					sampleMask |= 1 << sample;
+				}
+				if (sampleMask == 0) {
+					continue;
 				}
 
-				if (renderFlags[ERF_DEPTH_TEST] && depth < depthBufferPtr->getPixelf(x, invY).x) {
-					goto LB_CONTINUE;
+				// Pre-pass, only the depth buffer is written
+				if (DepthOnly) {
+					if (DepthMask) {
+						for (unsigned int sample = 0; sample < samples; ++sample) {
+							if ((sampleMask & (1 << sample)) == 0) {
+								continue;
+							}
+							const int sx = px * samples + sample;
+							if (direct) {
+								depthRow[sx] = depth[sample];
+							} else {
+								depthBufferPtr->setPixelf(sx, invY, vec4(depth[sample], depth[sample], depth[sample], 1.0f));
+							}
+						}
+					}
+					continue;
 				}
-				
+
 				// Prepare for pixel shader
 				PixelShaderData pixelShaderData;
 
 				for (unsigned int index = 0; index < MaxTextureCount; ++index) {
 					pixelShaderData.texture[index] = activeTexture[index];
 				}
+				pixelShaderData.lights = lightGrid;
+				pixelShaderData.x = px;
+				pixelShaderData.y = y + row;
+				pixelShaderData.instance = triangle.instance;
+
+				// Standard attributes are interpolated in screen space
+				const float* value = rowValue[row];
+				for (unsigned int component = 0; component < 4; ++component) {
+					pixelShaderData.normal[component] = value[EAP_NORMAL + component] + planeDx[EAP_NORMAL + component] * lane;
+					pixelShaderData.color[component] = value[EAP_COLOR + component] + planeDx[EAP_COLOR + component] * lane;
+				}
+				pixelShaderData.uv = uv[row][column];
+				pixelShaderData.uvDx = uvDx;
+				pixelShaderData.uvDy = uvDy;
 
-				// Interpolate standard attributes
-				for (uint32_t index = 0; index < 3; ++ index) {
-					pixelShaderData.normal += vertex[index].normal * weight[index];
-					pixelShaderData.uv     += vertex[index].uv     * weight[index] * perspectiveFix;
-					pixelShaderData.color  += vertex[index].color  * weight[index];
+				// User defined attributes are perspective correct like uv
+				for (unsigned int component = 0; component < varyingCount * 4; ++component) {
+					pixelShaderData.varying[component / 4][component % 4] = (value[EAP_VARYING + component] + planeDx[EAP_VARYING + component] * lane) * perspectiveFix[row][column];
 				}
-#if 0
-				// Interpolate user defined attributes
-				if (activeShader->totalVaryingData != NULL) {
-					const unsigned int vxc = 3;
-					const unsigned int vrc = activeShader->varyingCount;
-
-					for (unsigned int index = 0; index < vrc; ++index) {
-						activeShader->totalVaryingData[vxc * vrc + index] =
-							activeShader->totalVaryingData[0 * vrc + index] * weight.x +
-							activeShader->totalVaryingData[1 * vrc + index] * weight.y +
-							activeShader->totalVaryingData[2 * vrc + index] * weight.z;
+
+				activeShader->pixelShader(pixelShaderData);
+
+				// Sorted and blended later by resolveTransparency(), without a depth write
+				if (AlphaBlend && (Multisample == false) && (target.fragments != NULL)) {
+					target.fragments->insert(px, y + row, pixelShaderData.color, depth[0]);
+					continue;
+				}
+
+				// G-buffer draws leave the color buffer to renderLights(), they are never multisampled
+				if (GBuffer) {
+					vec3 normal(pixelShaderData.normal.x, pixelShaderData.normal.y, pixelShaderData.normal.z);
+					normal.normalize();
+					const vec4 packedNormal(normal.x * 0.5f + 0.5f, normal.y * 0.5f + 0.5f, normal.z * 0.5f + 0.5f, 1.0f);
+
+					if (direct) {
+						const unsigned int offset = invY * target.geometryStride + px * 4;
+						writeColor<Image::EPF_R8G8B8A8>(target.geometry[0] + offset, pixelShaderData.color);
+						writeColor<Image::EPF_R8G8B8A8>(target.geometry[1] + offset, packedNormal);
+						writeColor<Image::EPF_R8G8B8A8>(target.geometry[2] + offset, pixelShaderData.material);
+					} else {
+						geometryBufferPtr[0]->setPixelf(px, invY, pixelShaderData.color);
+						geometryBufferPtr[1]->setPixelf(px, invY, packedNormal);
+						geometryBufferPtr[2]->setPixelf(px, invY, pixelShaderData.material);
 					}
-					activeShader->varying = activeShader->totalVaryingData + 3 * activeShader->varyingCount;
+					if (DepthMask) {
+						if (direct) {
+							depthRow[px] = depth[0];
+						} else {
+							depthBufferPtr->setPixelf(px, invY, vec4(depth[0], depth[0], depth[0], 1.0f));
+						}
+					}
+					continue;
 				}
-#endif
-				activeShader->pixelShader(pixelShaderData);
 
-				if (renderFlags[ERF_ALPHA_BLEND]) {
-					const vec4 pixel = colorBufferPtr->getPixelf(x, invY);
-					const float inv = 1.0f - pixelShaderData.color.w;
-					pixelShaderData.color = pixelShaderData.color * pixelShaderData.color.w + pixel * inv;
+				for (unsigned int sample = 0; sample < samples; ++sample) {
+					if ((sampleMask & (1 << sample)) == 0) {
+						continue;
+					}
+					const int sx = px * samples + sample;
+
+					vec4 color = pixelShaderData.color;
+					if (AlphaBlend) {
+						const vec4 pixel = direct ? readColor<ColorFormat>(colorRow + sx * pixelSize) : colorBufferPtr->getPixelf(sx, invY);
+						const float inv = 1.0f - color.w;
+						color = color * color.w + pixel * inv;
+					}
+
+					if (direct) {
+						writeColor<ColorFormat>(colorRow + sx * pixelSize, color);
+					} else {
+						colorBufferPtr->setPixelf(sx, invY, color);
+					}
+
+					if (DepthMask) {
+						if (direct) {
+							depthRow[sx] = depth[sample];
+						} else {
+							depthBufferPtr->setPixelf(sx, invY, vec4(depth[sample], depth[sample], depth[sample], 1.0f));
+						}
+					}
 				}
+			}
+		}
+	}
+}
 
-				colorBufferPtr->setPixelf(x, invY, pixelShaderData.color);
+// Blending is ignored by G-buffer draws and depth only or multisampled draws
+// write no G-buffer, such combinations share the variant they reduce to
+#define SHADE_SPAN_VARIANT(format, flags) &Renderer::shadeSpanT<format, \
+	((flags) & 1) != 0, ((flags) & 2) != 0, ((flags) & 4) != 0 && ((flags) & 32) == 0, ((flags) & 8) != 0, ((flags) & 16) != 0, \
+	((flags) & 32) != 0 && ((flags) & 16) == 0 && ((flags) & 64) == 0, ((flags) & 64) != 0>
+
+#define SHADE_SPAN_VARIANTS_4(format, flags) \
+	SHADE_SPAN_VARIANT(format, (flags) + 0), SHADE_SPAN_VARIANT(format, (flags) + 1), \
+	SHADE_SPAN_VARIANT(format, (flags) + 2), SHADE_SPAN_VARIANT(format, (flags) + 3)
+
+#define SHADE_SPAN_VARIANTS_64(format, flags) \
+	SHADE_SPAN_VARIANTS_4(format, (flags) +  0), SHADE_SPAN_VARIANTS_4(format, (flags) +  4), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) +  8), SHADE_SPAN_VARIANTS_4(format, (flags) + 12), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 16), SHADE_SPAN_VARIANTS_4(format, (flags) + 20), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 24), SHADE_SPAN_VARIANTS_4(format, (flags) + 28), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 32), SHADE_SPAN_VARIANTS_4(format, (flags) + 36), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 40), SHADE_SPAN_VARIANTS_4(format, (flags) + 44), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 48), SHADE_SPAN_VARIANTS_4(format, (flags) + 52), \
+	SHADE_SPAN_VARIANTS_4(format, (flags) + 56), SHADE_SPAN_VARIANTS_4(format, (flags) + 60)
+
+#define SHADE_SPAN_FORMAT(format) { \
+	SHADE_SPAN_VARIANTS_64(format, 0), SHADE_SPAN_VARIANTS_64(format, 64) }
+
+const Renderer::ShadeSpanFunction Renderer::ShadeSpanTable[SpanFormatCount][SpanFlagCount] = {
+	SHADE_SPAN_FORMAT(Image::EPF_NONE),
+	SHADE_SPAN_FORMAT(Image::EPF_R8G8B8A8),
+	SHADE_SPAN_FORMAT(Image::EPF_R8G8B8)
+};
+
+#undef SHADE_SPAN_FORMAT
+#undef SHADE_SPAN_VARIANTS_64
+#undef SHADE_SPAN_VARIANTS_4
+#undef SHADE_SPAN_VARIANT
+
+bool Renderer::bindTarget() {
+	// Depth only targets, like shadow maps, take their size from the depth buffer
+	const Image* sizeBuffer = (colorBufferPtr != NULL) ? colorBufferPtr : depthBufferPtr;
+	if ((sizeBuffer == NULL) || ((colorBufferPtr == NULL) && (renderFlags[ERF_DEPTH_ONLY] == false))) {
+		return false;
+	}
+	const uvec2 bufferSize = sizeBuffer->getSize();
+	sampleCount = renderTarget->getSampleCount();
+	targetSize = uvec2(bufferSize.x / sampleCount, bufferSize.y);
+
+	target.color = NULL;
+	target.depth = NULL;
+	target.geometry[0] = NULL;
+	target.geometry[1] = NULL;
+	target.geometry[2] = NULL;
+	target.fragments = NULL;
+	target.colorStride = (colorBufferPtr != NULL) ? colorBufferPtr->getLineStride() : 0;
+	target.width = bufferSize.x;
+
+	// The rasterizer never leaves the color buffer, so the depth buffer has to match it
+	const bool depthUsed = renderFlags[ERF_DEPTH_TEST] || renderFlags[ERF_DEPTH_MASK];
+	const bool depthDirect = (depthUsed == false) || ((depthBufferPtr != NULL) &&
+		(depthBufferPtr->getPixelFormat() == Image::EPF_DEPTH) &&
+		(depthBufferPtr->getSize() == bufferSize));
+
+	unsigned int format = 0;
+	if (depthDirect && (colorBufferPtr == NULL)) {
+		// Depth only variants never touch the color buffer, any direct format will do
+		format = 1;
+	} else if (depthDirect) {
+		switch (colorBufferPtr->getPixelFormat()) {
+		case Image::EPF_R8G8B8A8 :
+			format = 1;
+			break;
+		case Image::EPF_R8G8B8 :
+			format = 2;
+			break;
+		default :
+			break;
+		}
+	}
 
-				if (renderFlags[ERF_DEPTH_MASK]) {
-					depthBufferPtr->setPixelf(x, invY, vec4(depth, depth, depth, 1.0f));
+	// G-buffer draws need all three attachments, written in place only if all are R8G8B8A8.
+	// Multisampled targets shade forward instead
+	const bool gbuffer = renderFlags[ERF_GBUFFER] && (renderFlags[ERF_DEPTH_ONLY] == false) && (sampleCount == 1) &&
+		(geometryBufferPtr[0] != NULL) && (geometryBufferPtr[1] != NULL) && (geometryBufferPtr[2] != NULL);
+	if (gbuffer) {
+		for (unsigned int index = 0; index < 3; ++index) {
+			if ((geometryBufferPtr[index]->getPixelFormat() != Image::EPF_R8G8B8A8) ||
+				(geometryBufferPtr[index]->getSize() != targetSize)) {
+				format = 0;
+			}
+		}
+	}
+
+	if (format != 0) {
+		target.color = (colorBufferPtr != NULL) ? colorBufferPtr->getData() : NULL;
+		if (depthUsed) {
+			target.depth = (float*)depthBufferPtr->getData();
+		}
+		if (gbuffer) {
+			for (unsigned int index = 0; index < 3; ++index) {
+				target.geometry[index] = geometryBufferPtr[index]->getData();
+			}
+			target.geometryStride = geometryBufferPtr[0]->getLineStride();
+		}
+	}
+
+	// Fragment lists are per pixel, multisampled targets keep blending in order
+	if (renderFlags[ERF_ORDER_INDEPENDENT] && renderFlags[ERF_ALPHA_BLEND] && (gbuffer == false) &&
+		(renderFlags[ERF_DEPTH_ONLY] == false) && (sampleCount == 1)) {
+		target.fragments = &renderTarget->fragmentBuffer;
+		target.fragments->resize(targetSize);
+	}
+
+	const unsigned int flags =
+		(renderFlags[ERF_DEPTH_TEST] ? 1 : 0) |
+		(renderFlags[ERF_DEPTH_MASK] ? 2 : 0) |
+		((renderFlags[ERF_ALPHA_BLEND] && (gbuffer == false)) ? 4 : 0) |
+		(renderFlags[GFX_PERSPECTIVE_CORRECT] ? 8 : 0) |
+		(renderFlags[ERF_DEPTH_ONLY] ? 16 : 0) |
+		(gbuffer ? 32 : 0) |
+		((sampleCount > 1) ? 64 : 0);
+
+	// Hierarchical Z needs direct single sample depth access, any other depth write makes it stale
+	hierarchicalZ = NULL;
+	HierarchicalZ& targetZ = renderTarget->hierarchicalZ;
+	if (targetZ.isValid()) {
+		if ((target.depth != NULL) && (sampleCount == 1) && (targetZ.getSize() == targetSize)) {
+			hierarchicalZ = &targetZ;
+		} else if (renderFlags[ERF_DEPTH_MASK]) {
+			targetZ.invalidate();
+		}
+	}
+
+	shadeSpan = ShadeSpanTable[format][flags];
+	spanVariant = format * SpanFlagCount + flags;
+	++spanVariantDraws[spanVariant];
+
+	return true;
+}
+
+// Bound of the edge values handed to the 32 bit span kernels
+static const int64_t EdgeClamp = 1 << 30;
+
+void Renderer::rasterizeTriangle(const Triangle& triangle, int tileMinX, int tileMinY, int tileMaxX, int tileMaxY) {
+	const int minX = max(triangle.minX, tileMinX);
+	const int minY = max(triangle.minY, tileMinY);
+	const int maxX = min(triangle.maxX, tileMaxX);
+	const int maxY = min(triangle.maxY, tileMaxY);
+
+	const int* edgeDx = triangle.edgeDx;
+	const int* edgeDy = triangle.edgeDy;
+	const float depthOrigin = triangle.planeOrigin[EAP_DEPTH];
+	const float depthDx = triangle.planeDx[EAP_DEPTH];
+	const float depthDy = triangle.planeDy[EAP_DEPTH];
+	const unsigned int samples = sampleCount;
+	SpanCoverage span[2 * RenderTarget::MaxSampleCount];
+	unsigned int mask[2 * RenderTarget::MaxSampleCount];
+
+	// Edge and depth offsets of every sample from the pixel center. The edge
+	// steps are multiples of the subpixel scale, so the offsets are exact
+	int sampleEdge[RenderTarget::MaxSampleCount][3];
+	float sampleDepth[RenderTarget::MaxSampleCount];
+	for (unsigned int sample = 0; sample < samples; ++sample) {
+		const int offsetX = (samples > 1) ? SamplePosition[sample][0] : 0;
+		const int offsetY = (samples > 1) ? SamplePosition[sample][1] : 0;
+		for (unsigned int index = 0; index < 3; ++index) {
+			sampleEdge[sample][index] = (edgeDx[index] / SubpixelScale) * offsetX + (edgeDy[index] / SubpixelScale) * offsetY;
+		}
+		sampleDepth[sample] = (depthDx * offsetX + depthDy * offsetY) / SubpixelScale;
+	}
+
+	// Walk SpanWidth x SpanWidth blocks aligned to the screen, a block row is a single span
+	const int blockSize = SpanWidth;
+
+	// Depth plane steps across a whole block, to bound the depth of a block from its corners
+	const bool depthReject = (hierarchicalZ != NULL) && renderFlags[ERF_DEPTH_TEST];
+	const bool depthUpdate = (hierarchicalZ != NULL) && renderFlags[ERF_DEPTH_MASK] && (target.fragments == NULL);
+	const float depthCol = depthDx * (blockSize - 1);
+	const float depthRow = depthDy * (blockSize - 1);
+
+	for (int blockY = minY & ~(blockSize - 1); blockY <= maxY; blockY += blockSize) {
+		const int y0 = max(blockY, minY);
+		const int y1 = min(blockY + blockSize - 1, maxY);
+
+		for (int blockX = minX & ~(blockSize - 1); blockX <= maxX; blockX += blockSize) {
+			// Edge values at the first pixel of the block
+			int64_t origin[3];
+			for (unsigned int index = 0; index < 3; ++index) {
+				origin[index] = triangle.edgeOrigin[index] + (int64_t)edgeDx[index] * blockX + (int64_t)edgeDy[index] * blockY;
+			}
+
+			// Rejected if every sample is outside, inside if every sample is inside
+			int classification = 1;
+			bool rejected = true;
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				int64_t sampleOrigin[3];
+				for (unsigned int index = 0; index < 3; ++index) {
+					sampleOrigin[index] = origin[index] + sampleEdge[sample][index];
+				}
+
+				const int sampleClassification = classifyBlock(sampleOrigin, edgeDx, edgeDy);
+				if (sampleClassification >= 0) {
+					rejected = false;
 				}
+				classification = min(classification, sampleClassification);
 			}
-LB_CONTINUE:
-			col += deltaCol;
+			if (rejected) {
+				continue;
+			}
+
+			// Blocks entirely behind the stored depth are never shaded
+			if (depthReject) {
+				const float blockDepth = depthOrigin + depthDx * blockX + depthDy * blockY;
+				const float blockMaxDepth = min(blockDepth + max(depthCol, 0.0f) + max(depthRow, 0.0f), triangle.maxDepth);
+				if (blockMaxDepth + HierarchicalZBias < hierarchicalZ->getBlock(blockX / blockSize, blockY / blockSize).minDepth) {
+					continue;
+				}
+			}
+
+			// Blocks inside all three edges skip the per pixel edge tests
+			const SpanCoverageFunction coverage = (classification > 0) ? spanFill : spanCoverage;
+
+			// Drop the lanes outside of the bounding box
+			const int x0 = max(blockX, minX);
+			const int x1 = min(blockX + blockSize - 1, maxX);
+			const unsigned int laneMask = ((2u << (x1 - blockX)) - 1) & ~((1u << (x0 - blockX)) - 1);
+
+			// Rows go in pairs for the 2x2 quads, rows outside of [y0, y1] only provide helper pixels
+			bool shaded = false;
+			const int quadY = y0 & ~1;
+			int edgeRow[RenderTarget::MaxSampleCount][3];
+			float rowDepth[RenderTarget::MaxSampleCount];
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				for (unsigned int index = 0; index < 3; ++index) {
+					// A block steps far less than EdgeClamp, so clamping keeps the sign of every pixel
+					const int64_t value = origin[index] + (int64_t)edgeDy[index] * (quadY - blockY) + sampleEdge[sample][index];
+					edgeRow[sample][index] = (int)min(max(value, -EdgeClamp), EdgeClamp);
+				}
+				rowDepth[sample] = depthOrigin + depthDx * blockX + depthDy * quadY + sampleDepth[sample];
+			}
+			for (int y = quadY; y <= y1; y += 2) {
+				unsigned int covered = 0;
+				for (int row = 0; row < 2; ++row) {
+					const bool inside = (y + row >= y0) && (y + row <= y1);
+					for (unsigned int sample = 0; sample < samples; ++sample) {
+						unsigned int& sampleMask = mask[row * samples + sample];
+						sampleMask = coverage(edgeRow[sample], edgeDx, rowDepth[sample], depthDx, span[row * samples + sample]) & laneMask;
+						if (inside == false) {
+							sampleMask = 0;
+						}
+						covered |= sampleMask;
+						for (unsigned int index = 0; index < 3; ++index) {
+							edgeRow[sample][index] += edgeDy[index];
+						}
+						rowDepth[sample] += depthDy;
+					}
+				}
+
+				if (covered != 0) {
+					(this->*shadeSpan)(triangle, span, mask, blockX, y);
+					shaded = true;
+				}
+			}
+
+			if (depthUpdate && shaded) {
+				hierarchicalZ->updateBlock(blockX / blockSize, blockY / blockSize, target.depth);
+			}
+		}
+	}
+}
+	
+void Renderer::drawTriangle(const TransformedVertex& v0, const TransformedVertex& v1, const TransformedVertex& v2) {
+	// All three vertices outside of the same plane
+	if ((v0.clipCode & v1.clipCode & v2.clipCode) != 0) {
+		return;
+	}
+
+	const unsigned int clipCode = v0.clipCode | v1.clipCode | v2.clipCode;
+	if (clipCode == 0) {
+		submitTriangle(v0, v1, v2);
+	} else {
+		clipTriangle(v0, v1, v2, clipCode);
+	}
+}
+
+//https://en.wikipedia.org/wiki/Sutherland%E2%80%93Hodgman_algorithm
+void Renderer::clipTriangle(const TransformedVertex& v0, const TransformedVertex& v1, const TransformedVertex& v2, unsigned int clipCode) {
+	// Every plane adds at most one vertex
+	TransformedVertex buffer[2][3 + ECP_COUNT];
+	TransformedVertex* input = buffer[0];
+	TransformedVertex* output = buffer[1];
+	unsigned int count = 3;
+
+	input[0] = v0;
+	input[1] = v1;
+	input[2] = v2;
+
+	for (unsigned int plane = 0; plane < ECP_COUNT; ++plane) {
+		if ((clipCode & (1 << plane)) == 0) {
+			continue;
+		}
+
+		unsigned int outputCount = 0;
+		for (unsigned int index = 0; index < count; ++index) {
+			const TransformedVertex& current = input[index];
+			const TransformedVertex& next = input[(index + 1) % count];
+			const float currentDistance = clipDistance(current.data.position, plane);
+			const float nextDistance = clipDistance(next.data.position, plane);
+
+			if (currentDistance >= 0.0f) {
+				output[outputCount++] = current;
+			}
+
+			if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+				// Always interpolate from the inside vertex so shared edges split at the same point
+				TransformedVertex& split = output[outputCount++];
+				if (currentDistance >= 0.0f) {
+					split.data = lerpVertex(current.data, next.data, currentDistance / (currentDistance - nextDistance), varyingCount);
+				} else {
+					split.data = lerpVertex(next.data, current.data, nextDistance / (nextDistance - currentDistance), varyingCount);
+				}
+				split.screen = projectVertex(split.data.position);
+				split.clipCode = 0;
+			}
+		}
+
+		TransformedVertex* swap = input;
+		input = output;
+		output = swap;
+		count = outputCount;
+
+		if (count < 3) {
+			return;
+		}
+	}
+
+	// The clipped polygon is convex, so a fan keeps the original winding
+	for (unsigned int index = 1; index < count - 1; ++index) {
+		submitTriangle(input[0], input[index], input[index + 1]);
+	}
+}
+
+void Renderer::submitTriangle(const TransformedVertex& v0, const TransformedVertex& v1, const TransformedVertex& v2) {
+	if (threadPool == NULL) {
+		Triangle triangle;
+		if (setupTriangle(v0, v1, v2, triangle)) {
+			rasterizeTriangle(triangle, 0, 0, targetSize.x - 1, targetSize.y - 1);
 		}
-		row += deltaRow;
+		return;
+	}
+
+	triangles.resize(triangles.size() + 1);
+	Triangle& triangle = triangles.back();
+	if (setupTriangle(v0, v1, v2, triangle) == false) {
+		triangles.pop_back();
+		return;
+	}
+
+	// Triangles are appended in submission order, so every bin stays sorted
+	const unsigned int triangleIndex = triangles.size() - 1;
+	const int tileMinX = triangle.minX / TileSize;
+	const int tileMinY = triangle.minY / TileSize;
+	const int tileMaxX = triangle.maxX / TileSize;
+	const int tileMaxY = triangle.maxY / TileSize;
+
+	for (int tileY = tileMinY; tileY <= tileMaxY; ++tileY) {
+		for (int tileX = tileMinX; tileX <= tileMaxX; ++tileX) {
+			std::vector<unsigned int>& bin = tileBins[tileY * tileCount.x + tileX];
+			if (bin.empty()) {
+				activeTiles.push_back(tileY * tileCount.x + tileX);
+			}
+			bin.push_back(triangleIndex);
+		}
+	}
+}
+
+void Renderer::RasterizeTileTask(void* userData, unsigned int taskIndex, unsigned int /*threadIndex*/) {
+	Renderer* renderer = (Renderer*)userData;
+	const unsigned int tileIndex = renderer->activeTiles[taskIndex];
+	const std::vector<unsigned int>& bin = renderer->tileBins[tileIndex];
+
+	const uvec2 size = renderer->targetSize;
+	const int tileMinX = (tileIndex % renderer->tileCount.x) * TileSize;
+	const int tileMinY = (tileIndex / renderer->tileCount.x) * TileSize;
+	const int tileMaxX = min(tileMinX + TileSize, (int)size.x) - 1;
+	const int tileMaxY = min(tileMinY + TileSize, (int)size.y) - 1;
+
+	for (unsigned int index = 0; index < bin.size(); ++index) {
+		renderer->rasterizeTriangle(renderer->triangles[bin[index]], tileMinX, tileMinY, tileMaxX, tileMaxY);
 	}
 }
+
+void Renderer::beginBinning() {
+	if (threadPool == NULL) {
+		return;
+	}
+
+	const uvec2 size = targetSize;
+	const uvec2 newTileCount((size.x + TileSize - 1) / TileSize, (size.y + TileSize - 1) / TileSize);
+	if (newTileCount != tileCount) {
+		tileCount = newTileCount;
+		tileBins.clear();
+		tileBins.resize(tileCount.x * tileCount.y);
+	}
+}
+
+void Renderer::flushBins() {
+	if (threadPool == NULL) {
+		return;
+	}
+
+	// Every tile is owned by a single thread, so no two threads touch the same pixel
+	threadPool->run(RasterizeTileTask, this, activeTiles.size());
+
+	for (unsigned int index = 0; index < activeTiles.size(); ++index) {
+		tileBins[activeTiles[index]].clear();
+	}
+	activeTiles.clear();
+	triangles.clear();
+}
 	
+void Renderer::shadeLights(int minX, int minY, int maxX, int maxY) {
+	const int height = colorBufferPtr->getSize().y;
+	const bool direct = (lightPass.target.color != NULL);
+	const unsigned int colorFormat = colorBufferPtr->getPixelFormat();
+	const unsigned int pixelSize = (colorFormat == Image::EPF_R8G8B8A8) ? 4 : 3;
+
+	for (int y = minY; y <= maxY; ++y) {
+		const int invY = height - 1 - y;
+		const float* depthRow = direct ? lightPass.target.depth + invY * lightPass.target.width : NULL;
+
+		for (int x = minX; x <= maxX; ++x) {
+			// Nothing was drawn where the depth is still cleared
+			const float depth = direct ? depthRow[x] : depthBufferPtr->getPixelf(x, invY).x;
+			if (depth <= 0.0f) {
+				continue;
+			}
+
+			vec4 albedo;
+			vec4 packedNormal;
+			vec4 material;
+			if (direct) {
+				const unsigned int offset = invY * lightPass.target.geometryStride + x * 4;
+				albedo = readColor<Image::EPF_R8G8B8A8>(lightPass.target.geometry[0] + offset);
+				packedNormal = readColor<Image::EPF_R8G8B8A8>(lightPass.target.geometry[1] + offset);
+				material = readColor<Image::EPF_R8G8B8A8>(lightPass.target.geometry[2] + offset);
+			} else {
+				albedo = geometryBufferPtr[0]->getPixelf(x, invY);
+				packedNormal = geometryBufferPtr[1]->getPixelf(x, invY);
+				material = geometryBufferPtr[2]->getPixelf(x, invY);
+			}
+
+			vec3 normal(packedNormal.x * 2.0f - 1.0f, packedNormal.y * 2.0f - 1.0f, packedNormal.z * 2.0f - 1.0f);
+			normal.normalize();
+
+			// Same pixel center and depth the rasterizer stored, back through viewport and projection
+			const vec4 position = lightPass.screenToWorld * vec4(x + 0.5f, y + 0.5f, 1.0f - depth, 1.0f);
+			const vec3 surfacePosition = vec3(position.x, position.y, position.z) * (1.0f / position.w);
+			const vec3 surfaceAlbedo(albedo.x, albedo.y, albedo.z);
+
+			vec3 color(0.0f, 0.0f, 0.0f);
+			for (unsigned int index = 0; index < lightPass.lightCount; ++index) {
+				color += lightPass.lights[index].evaluate(surfacePosition, normal, lightPass.eyePosition, surfaceAlbedo, material);
+			}
+
+			const vec4 result(min(color.x, 1.0f), min(color.y, 1.0f), min(color.z, 1.0f), albedo.w);
+			if (direct == false) {
+				colorBufferPtr->setPixelf(x, invY, result);
+			} else if (colorFormat == Image::EPF_R8G8B8A8) {
+				writeColor<Image::EPF_R8G8B8A8>(lightPass.target.color + invY * lightPass.target.colorStride + x * pixelSize, result);
+			} else {
+				writeColor<Image::EPF_R8G8B8>(lightPass.target.color + invY * lightPass.target.colorStride + x * pixelSize, result);
+			}
+		}
+	}
+}
+
+void Renderer::ShadeLightsTask(void* userData, unsigned int taskIndex, unsigned int /*threadIndex*/) {
+	Renderer* renderer = (Renderer*)userData;
+
+	const uvec2 size = renderer->colorBufferPtr->getSize();
+	const unsigned int tileColumns = (size.x + TileSize - 1) / TileSize;
+	const int tileMinX = (taskIndex % tileColumns) * TileSize;
+	const int tileMinY = (taskIndex / tileColumns) * TileSize;
+
+	renderer->shadeLights(tileMinX, tileMinY, min(tileMinX + TileSize, (int)size.x) - 1, min(tileMinY + TileSize, (int)size.y) - 1);
+}
+
+void Renderer::renderLights(const Light* lights, unsigned int lightCount, const mat4& viewProjection, const vec3& eyePosition) {
+	if ((renderTarget == NULL) || (colorBufferPtr == NULL) || (depthBufferPtr == NULL)) {
+		return;
+	}
+
+	// G-buffers are single sampled, multisampled targets shade forward
+	if (renderTarget->getSampleCount() != 1) {
+		return;
+	}
+
+	for (unsigned int index = 0; index < 3; ++index) {
+		if (geometryBufferPtr[index] == NULL) {
+			return;
+		}
+	}
+
+	// Raw buffers when every attachment has the layout the span writer uses
+	const uvec2 size = colorBufferPtr->getSize();
+	bool direct = (depthBufferPtr->getPixelFormat() == Image::EPF_DEPTH) && (depthBufferPtr->getSize() == size) &&
+		((colorBufferPtr->getPixelFormat() == Image::EPF_R8G8B8A8) || (colorBufferPtr->getPixelFormat() == Image::EPF_R8G8B8));
+	for (unsigned int index = 0; index < 3; ++index) {
+		if ((geometryBufferPtr[index]->getPixelFormat() != Image::EPF_R8G8B8A8) || (geometryBufferPtr[index]->getSize() != size)) {
+			direct = false;
+		}
+	}
+
+	lightPass.target.color = NULL;
+	if (direct) {
+		lightPass.target.color = colorBufferPtr->getData();
+		lightPass.target.depth = (float*)depthBufferPtr->getData();
+		lightPass.target.colorStride = colorBufferPtr->getLineStride();
+		lightPass.target.width = size.x;
+		for (unsigned int index = 0; index < 3; ++index) {
+			lightPass.target.geometry[index] = geometryBufferPtr[index]->getData();
+		}
+		lightPass.target.geometryStride = geometryBufferPtr[0]->getLineStride();
+	}
+
+	lightPass.lights = lights;
+	lightPass.lightCount = lightCount;
+	lightPass.screenToWorld = viewProjection.getInverse() * viewportTransformation.getInverse();
+	lightPass.eyePosition = eyePosition;
+
+	if (threadPool == NULL) {
+		shadeLights(0, 0, size.x - 1, size.y - 1);
+		return;
+	}
+
+	// Same tiles as binning, every pixel is independent
+	const unsigned int tileColumns = (size.x + TileSize - 1) / TileSize;
+	const unsigned int tileRows = (size.y + TileSize - 1) / TileSize;
+	threadPool->run(ShadeLightsTask, this, tileColumns * tileRows);
+}
+
+// Rounded average of the MaxSampleCount samples of every pixel in a row
+template <unsigned int Format>
+static void ResolveRow(const uint8_t* source, uint8_t* destination, unsigned int width) {
+	const unsigned int pixelSize = ColorPixelSize<Format>::value;
+
+	for (unsigned int x = 0; x < width; ++x) {
+		for (unsigned int channel = 0; channel < pixelSize; ++channel) {
+			unsigned int sum = RenderTarget::MaxSampleCount / 2;
+			for (unsigned int sample = 0; sample < RenderTarget::MaxSampleCount; ++sample) {
+				sum += source[sample * pixelSize + channel];
+			}
+			destination[channel] = sum / RenderTarget::MaxSampleCount;
+		}
+		source += pixelSize * RenderTarget::MaxSampleCount;
+		destination += pixelSize;
+	}
+}
+
+void Renderer::resolve(Image* destination) {
+	if ((renderTarget == NULL) || (colorBufferPtr == NULL) || (destination == NULL)) {
+		return;
+	}
+
+	const unsigned int samples = renderTarget->getSampleCount();
+	const uvec2 size = destination->getSize();
+	if ((colorBufferPtr->getSize().x != size.x * samples) || (colorBufferPtr->getSize().y != size.y)) {
+		return;
+	}
+
+	// Same layout on both sides, every channel is averaged in place
+	const unsigned int format = colorBufferPtr->getPixelFormat();
+	if ((samples == RenderTarget::MaxSampleCount) && (format == destination->getPixelFormat()) &&
+		((format == Image::EPF_R8G8B8A8) || (format == Image::EPF_R8G8B8))) {
+		for (unsigned int y = 0; y < size.y; ++y) {
+			const uint8_t* source = colorBufferPtr->getData() + y * colorBufferPtr->getLineStride();
+			uint8_t* pixel = destination->getData() + y * destination->getLineStride();
+
+			if (format == Image::EPF_R8G8B8A8) {
+				ResolveRow<Image::EPF_R8G8B8A8>(source, pixel, size.x);
+			} else {
+				ResolveRow<Image::EPF_R8G8B8>(source, pixel, size.x);
+			}
+		}
+		return;
+	}
+
+	const float scale = 1.0f / samples;
+	for (unsigned int y = 0; y < size.y; ++y) {
+		for (unsigned int x = 0; x < size.x; ++x) {
+			vec4 color(0.0f, 0.0f, 0.0f, 0.0f);
+			for (unsigned int sample = 0; sample < samples; ++sample) {
+				color += colorBufferPtr->getPixelf(x * samples + sample, y);
+			}
+			destination->setPixelf(x, y, color * scale);
+		}
+	}
+}
+
+// Fragments blended per pixel by resolveTransparency(), the farthest ones beyond are dropped
+static const unsigned int MaxPixelFragments = 32;
+
+void Renderer::compositeFragments(int minX, int minY, int maxX, int maxY) {
+	FragmentBuffer& fragments = renderTarget->fragmentBuffer;
+	const uvec2 size = colorBufferPtr->getSize();
+	const unsigned int colorFormat = colorBufferPtr->getPixelFormat();
+	const bool direct = (colorFormat == Image::EPF_R8G8B8A8) || (colorFormat == Image::EPF_R8G8B8);
+	const unsigned int pixelSize = (colorFormat == Image::EPF_R8G8B8A8) ? 4 : 3;
+	uint8_t* colorData = direct ? colorBufferPtr->getData() : NULL;
+	const unsigned int colorStride = colorBufferPtr->getLineStride();
+
+	// Opaque geometry drawn after the fragments still hides them
+	const bool depthTest = (depthBufferPtr != NULL) && (depthBufferPtr->getSize() == size);
+	const float* depthData = (depthTest && (depthBufferPtr->getPixelFormat() == Image::EPF_DEPTH)) ? (const float*)depthBufferPtr->getData() : NULL;
+
+	const FragmentBuffer::Fragment* sorted[MaxPixelFragments];
+
+	for (int y = minY; y <= maxY; ++y) {
+		const int invY = size.y - 1 - y;
+
+		for (int x = minX; x <= maxX; ++x) {
+			unsigned int index = fragments.takeList(x, y);
+			if (index == FragmentBuffer::EndOfList) {
+				continue;
+			}
+
+			float opaqueDepth = 0.0f;
+			if (depthData != NULL) {
+				opaqueDepth = depthData[invY * size.x + x];
+			} else if (depthTest) {
+				opaqueDepth = depthBufferPtr->getPixelf(x, invY).x;
+			}
+
+			// Insertion sort, farthest first. Lists start at the last fragment
+			// drawn, so equal depths go before the ones already sorted to keep
+			// the draw order
+			unsigned int count = 0;
+			for (; index != FragmentBuffer::EndOfList; index = fragments.getFragment(index).next) {
+				const FragmentBuffer::Fragment& fragment = fragments.getFragment(index);
+				if (fragment.depth < opaqueDepth) {
+					continue;
+				}
+
+				if (count == MaxPixelFragments) {
+					if (fragment.depth <= sorted[0]->depth) {
+						continue;
+					}
+					for (unsigned int slot = 1; slot < count; ++slot) {
+						sorted[slot - 1] = sorted[slot];
+					}
+					--count;
+				}
+
+				unsigned int slot = count++;
+				for (; (slot > 0) && (sorted[slot - 1]->depth >= fragment.depth); --slot) {
+					sorted[slot] = sorted[slot - 1];
+				}
+				sorted[slot] = &fragment;
+			}
+			if (count == 0) {
+				continue;
+			}
+
+			// Same blend equation as the span writer
+			uint8_t* pixel = direct ? colorData + invY * colorStride + x * pixelSize : NULL;
+			vec4 color;
+			if (direct == false) {
+				color = colorBufferPtr->getPixelf(x, invY);
+			} else if (colorFormat == Image::EPF_R8G8B8A8) {
+				color = readColor<Image::EPF_R8G8B8A8>(pixel);
+			} else {
+				color = readColor<Image::EPF_R8G8B8>(pixel);
+			}
+
+			for (unsigned int slot = 0; slot < count; ++slot) {
+				const vec4& source = sorted[slot]->color;
+				color = source * source.w + color * (1.0f - source.w);
+			}
+
+			if (direct == false) {
+				colorBufferPtr->setPixelf(x, invY, color);
+			} else if (colorFormat == Image::EPF_R8G8B8A8) {
+				writeColor<Image::EPF_R8G8B8A8>(pixel, color);
+			} else {
+				writeColor<Image::EPF_R8G8B8>(pixel, color);
+			}
+		}
+	}
+}
+
+void Renderer::CompositeFragmentsTask(void* userData, unsigned int taskIndex, unsigned int /*threadIndex*/) {
+	Renderer* renderer = (Renderer*)userData;
+
+	const uvec2 size = renderer->colorBufferPtr->getSize();
+	const unsigned int tileColumns = (size.x + TileSize - 1) / TileSize;
+	const int tileMinX = (taskIndex % tileColumns) * TileSize;
+	const int tileMinY = (taskIndex / tileColumns) * TileSize;
+
+	renderer->compositeFragments(tileMinX, tileMinY, min(tileMinX + TileSize, (int)size.x) - 1, min(tileMinY + TileSize, (int)size.y) - 1);
+}
+
+void Renderer::resolveTransparency() {
+	if ((renderTarget == NULL) || (colorBufferPtr == NULL)) {
+		return;
+	}
+
+	FragmentBuffer& fragments = renderTarget->fragmentBuffer;
+	if (fragments.getFragmentCount() == 0) {
+		return;
+	}
+
+	// Lists left from a color buffer of another size cannot be placed
+	const uvec2 size = colorBufferPtr->getSize();
+	if (fragments.getSize() != size) {
+		fragments.clear();
+		return;
+	}
+
+	if (threadPool == NULL) {
+		compositeFragments(0, 0, size.x - 1, size.y - 1);
+	} else {
+		// Every pixel list is independent, same tiles as renderLights()
+		const unsigned int tileColumns = (size.x + TileSize - 1) / TileSize;
+		const unsigned int tileRows = (size.y + TileSize - 1) / TileSize;
+		threadPool->run(CompositeFragmentsTask, this, tileColumns * tileRows);
+	}
+
+	fragments.reset();
+}
+
 Renderer::Renderer() {
 	renderTarget = NULL;
 	for (unsigned int index = 0; index < MaxTextureCount; ++index) {
@@ -311,6 +1450,20 @@ Renderer::Renderer() {
 	}
 
 	activeShader = NULL;
+	lightGrid = NULL;
+	sampleCount = 1;
+	varyingCount = 0;
+	activeInstance = 0;
+	for (unsigned int index = 0; index < 3; ++index) {
+		geometryBufferPtr[index] = NULL;
+	}
+	threadPool = NULL;
+	shadeSpan = NULL;
+	hierarchicalZ = NULL;
+	spanVariant = 0;
+	resetSpanVariants();
+	spanCoverage = GetSpanCoverageFunction();
+	spanFill = GetSpanFillFunction();
 
 	for (unsigned int index = 0; index < ERF_COUNT; ++index) {
 		renderFlags[index] = false;
@@ -319,6 +1472,7 @@ Renderer::Renderer() {
 }
 
 Renderer::~Renderer() {
+	setThreadCount(1);
 }
 
 void Renderer::setRenderTarget(RenderTarget* newRenderTarget) {
@@ -326,6 +1480,9 @@ void Renderer::setRenderTarget(RenderTarget* newRenderTarget) {
 	if (renderTarget != NULL) {
 		colorBufferPtr = renderTarget->getBuffer(RenderTarget::ERT_COLOR_0);
 		depthBufferPtr = renderTarget->getBuffer(RenderTarget::ERT_DEPTH);
+		geometryBufferPtr[0] = renderTarget->getBuffer(RenderTarget::ERT_COLOR_1);
+		geometryBufferPtr[1] = renderTarget->getBuffer(RenderTarget::ERT_COLOR_2);
+		geometryBufferPtr[2] = renderTarget->getBuffer(RenderTarget::ERT_COLOR_3);
 	}
 }
 
@@ -385,11 +1542,71 @@ Shader* Renderer::getShader() const {
 	return activeShader;
 }
 
-void Renderer::render(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount) {
-	if (renderTarget == NULL) {
+void Renderer::setLightGrid(const LightGrid* grid) {
+	lightGrid = grid;
+}
+
+const LightGrid* Renderer::getLightGrid() const {
+	return lightGrid;
+}
+
+void Renderer::setThreadCount(unsigned int count) {
+	if (count == getThreadCount()) {
 		return;
 	}
 
+	if (threadPool != NULL) {
+		delete threadPool;
+		threadPool = NULL;
+	}
+
+	if (count > 1) {
+		threadPool = new ThreadPool();
+		threadPool->initialize(count);
+	}
+
+	tileCount = uvec2(0, 0);
+}
+
+unsigned int Renderer::getThreadCount() const {
+	return (threadPool != NULL) ? threadPool->getThreadCount() : 1;
+}
+
+unsigned int Renderer::getSpanVariant() const {
+	return spanVariant;
+}
+
+unsigned int Renderer::getSpanVariantDraws(unsigned int variant) const {
+	if (variant >= SpanFormatCount * SpanFlagCount) {
+		return 0;
+	}
+
+	return spanVariantDraws[variant];
+}
+
+void Renderer::printSpanVariants() const {
+	static const char* FormatNames[SpanFormatCount] = {"Image", "R8G8B8A8", "R8G8B8"};
+
+	for (unsigned int variant = 0; variant < SpanFormatCount * SpanFlagCount; ++variant) {
+		if (spanVariantDraws[variant] == 0) {
+			continue;
+		}
+
+		const unsigned int flags = variant % SpanFlagCount;
+		printf("Span variant %3u %-8s depth test %d depth mask %d blend %d perspective %d depth only %d gbuffer %d multisample %d: %u draws\n",
+			variant, FormatNames[variant / SpanFlagCount],
+			(flags & 1) != 0, (flags & 2) != 0, (flags & 4) != 0, (flags & 8) != 0, (flags & 16) != 0, (flags & 32) != 0, (flags & 64) != 0,
+			spanVariantDraws[variant]);
+	}
+}
+
+void Renderer::resetSpanVariants() {
+	for (unsigned int index = 0; index < SpanFormatCount * SpanFlagCount; ++index) {
+		spanVariantDraws[index] = 0;
+	}
+}
+
+void Renderer::drawPrimitives(const PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount) {
 	switch (primitiveType) {
 	case EPT_LINES :
 		if (vertexCount < 2) {
@@ -414,36 +1631,97 @@ void Renderer::render(const PrimitiveType primitiveType, const Vertex* vertices,
 		if (vertexCount < 3) {
 			return;
 		}
+		if (renderFlags[GFX_WIREFRAME] == false) {
+			processVertices(vertices, vertexCount);
+		}
 		for (unsigned int index = 0; index < vertexCount - 2; index += 3) {
 			if (renderFlags[GFX_WIREFRAME]) {
 				drawLine(vertices[index + 0].position, vertices[index + 0].color, vertices[index + 1]. position, vertices[index + 1].color);
 				drawLine(vertices[index + 1].position, vertices[index + 1].color, vertices[index + 2]. position, vertices[index + 2].color);
 				drawLine(vertices[index + 2].position, vertices[index + 2].color, vertices[index + 0]. position, vertices[index + 0].color);
 			} else {
-				drawTriangle(vertices[index + 0], vertices[index + 1], vertices[index + 2]);
+				drawTriangle(
+					fetchVertex(index + 0),
+					fetchVertex(index + 1),
+					fetchVertex(index + 2));
 			}
 		}
 		break;
 		
 	case EPT_TRIANGLE_STRIP :
+		if (renderFlags[GFX_WIREFRAME] == false) {
+			processVertices(vertices, vertexCount);
+		}
 		for (unsigned int index = 2, k = 1; index < vertexCount; ++index, k = !k) {
 			if (renderFlags[GFX_WIREFRAME]) {
 //				drawLine(vertices[index + 0].position, vertices[index + 0].color, vertices[index + 1]. position, vertices[index + 1].color);
 //				drawLine(vertices[index + 1].position, vertices[index + 1].color, vertices[index + 2]. position, vertices[index + 2].color);
 //				drawLine(vertices[index + 2].position, vertices[index + 2].color, vertices[index + 0]. position, vertices[index + 0].color);
 			} else {
-				drawTriangle(vertices[index - 0], vertices[index - (k ? 2 : 1)], vertices[index - (k ? 1 : 2)]);
+				drawTriangle(
+					fetchVertex(index - 0),
+					fetchVertex(index - (k ? 2 : 1)),
+					fetchVertex(index - (k ? 1 : 2)));
 			}
 		}
 		break;
 	}
 }
 
+void Renderer::render(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount) {
+	if (renderTarget == NULL) {
+		return;
+	}
+
+	if (bindTarget() == false) {
+		return;
+	}
+	beginBinning();
+
+	activeInstance = 0;
+	drawPrimitives(primitiveType, vertices, vertexCount);
+
+	flushBins();
+}
+
+void Renderer::renderInstanced(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount, const void* instanceData, const unsigned int instanceCount) {
+	if ((renderTarget == NULL) || (instanceCount == 0)) {
+		return;
+	}
+
+	if (bindTarget() == false) {
+		return;
+	}
+	beginBinning();
+
+	if (activeShader != NULL) {
+		activeShader->instanceData = instanceData;
+	}
+
+	// Binned triangles carry their instance, so all of them go through a single flush
+	for (unsigned int instance = 0; instance < instanceCount; ++instance) {
+		activeInstance = instance;
+		drawPrimitives(primitiveType, vertices, vertexCount);
+	}
+	activeInstance = 0;
+
+	flushBins();
+
+	if (activeShader != NULL) {
+		activeShader->instanceData = NULL;
+	}
+}
+
 void Renderer::render(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount, const unsigned int* indices, const unsigned int indexCount) {
 	if (renderTarget == NULL) {
 		return;
 	}
 
+	if (bindTarget() == false) {
+		return;
+	}
+	beginBinning();
+
 	switch (primitiveType) {
 	case EPT_LINES :
 		if (indexCount < 2) {
@@ -468,24 +1746,174 @@ void Renderer::render(const PrimitiveType primitiveType, const Vertex* vertices,
 		if (indexCount < 3) {
 			return;
 		}
+		if (renderFlags[GFX_WIREFRAME] == false) {
+			processVertices(vertices, vertexCount);
+		}
 		for (unsigned int index = 0; index < indexCount - 2; index += 3) {
-			
-			drawTriangle(
-				vertices[indices[index + 0]],
-				vertices[indices[index + 1]],
-				vertices[indices[index + 2]]);
+			if (renderFlags[GFX_WIREFRAME]) {
+				const Vertex& vertex0 = vertices[indices[index + 0]];
+				const Vertex& vertex1 = vertices[indices[index + 1]];
+				const Vertex& vertex2 = vertices[indices[index + 2]];
+				drawLine(vertex0.position, vertex0.color, vertex1.position, vertex1.color);
+				drawLine(vertex1.position, vertex1.color, vertex2.position, vertex2.color);
+				drawLine(vertex2.position, vertex2.color, vertex0.position, vertex0.color);
+			} else {
+				drawTriangle(
+					fetchVertex(indices[index + 0]),
+					fetchVertex(indices[index + 1]),
+					fetchVertex(indices[index + 2]));
+			}
 		}
 		break;
 		
 	case EPT_TRIANGLE_STRIP :
+		processVertices(vertices, vertexCount);
 		for (unsigned int index = 2, k = 1; index < indexCount; ++index, k = !k) {
 			drawTriangle(
-				vertices[indices[index - 0]],
-				vertices[indices[index - (k ? 2 : 1)]],
-				vertices[indices[index - (k ? 1 : 2)]]);
+				fetchVertex(indices[index - 0]),
+				fetchVertex(indices[index - (k ? 2 : 1)]),
+				fetchVertex(indices[index - (k ? 1 : 2)]));
 		}
 		break;
 	}
+
+	flushBins();
+}
+
+// Index of state in states, appended on first use. A frame only has a few
+// distinct shaders and textures
+static unsigned int FindState(std::vector<const void*>& states, const void* state) {
+	for (unsigned int index = 0; index < states.size(); ++index) {
+		if (states[index] == state) {
+			return index;
+		}
+	}
+
+	states.push_back(state);
+	return states.size() - 1;
+}
+
+// Draws blending in order go last and keep their relative order
+bool Renderer::SubmitOrder(const SubmittedDraw& a, const SubmittedDraw& b) {
+	if (a.ordered != b.ordered) {
+		return b.ordered;
+	}
+	if (a.ordered) {
+		return false;
+	}
+
+	if (a.shaderId != b.shaderId) {
+		return a.shaderId < b.shaderId;
+	}
+	for (unsigned int index = 0; index < MaxTextureCount; ++index) {
+		if (a.textureId[index] != b.textureId[index]) {
+			return a.textureId[index] < b.textureId[index];
+		}
+	}
+	if (a.flags != b.flags) {
+		return a.flags < b.flags;
+	}
+
+	return a.depth < b.depth;
+}
+
+bool Renderer::SubmitOrderFrontToBack(const SubmittedDraw& a, const SubmittedDraw& b) {
+	if ((a.ordered == false) && (b.ordered == false) && (a.depth != b.depth)) {
+		return a.depth < b.depth;
+	}
+
+	return SubmitOrder(a, b);
+}
+
+void Renderer::submit(CommandBuffer* const* buffers, unsigned int bufferCount, bool frontToBack) {
+	submittedDraws.clear();
+	submittedStates.clear();
+
+	// Flags a buffer never set keep their current value
+	unsigned int currentFlags = 0;
+	for (unsigned int index = 0; index < ERF_COUNT; ++index) {
+		currentFlags |= renderFlags[index] ? (1 << index) : 0;
+	}
+
+	// Fragment lists make blending independent of the order, unless multisampled
+	const bool orderIndependent = (renderTarget != NULL) && (renderTarget->getSampleCount() == 1);
+
+	for (unsigned int bufferIndex = 0; bufferIndex < bufferCount; ++bufferIndex) {
+		CommandBuffer* buffer = buffers[bufferIndex];
+
+		for (unsigned int index = 0; index < buffer->getDrawCount(); ++index) {
+			const CommandBuffer::Draw& draw = buffer->getDraw(index);
+
+			SubmittedDraw submitted;
+			submitted.buffer = buffer;
+			submitted.index = index;
+			submitted.flags = (currentFlags & ~draw.flagMask) | (draw.flagValues & draw.flagMask);
+			submitted.shader = (draw.shader != NULL) ? draw.shader : activeShader;
+			submitted.shaderId = FindState(submittedStates, submitted.shader);
+			for (unsigned int unit = 0; unit < MaxTextureCount; ++unit) {
+				submitted.texture[unit] = (draw.textureMask & (1 << unit)) ? draw.texture[unit] : activeTexture[unit];
+				submitted.textureId[unit] = FindState(submittedStates, submitted.texture[unit]);
+			}
+
+			const bool blend = (submitted.flags & (1 << ERF_ALPHA_BLEND)) && ((submitted.flags & (1 << ERF_GBUFFER)) == 0);
+			submitted.ordered = blend && ((orderIndependent && (submitted.flags & (1 << ERF_ORDER_INDEPENDENT))) == false);
+			submitted.depth = draw.depth;
+
+			submittedDraws.push_back(submitted);
+		}
+	}
+
+	if (submittedDraws.empty()) {
+		return;
+	}
+
+	// Stable, so draws of equal keys keep their recording order
+	submitOrder.resize(submittedDraws.size());
+	for (unsigned int index = 0; index < submitOrder.size(); ++index) {
+		submitOrder[index] = index;
+	}
+	SubmitCompare compare;
+	compare.draws = &submittedDraws[0];
+	compare.frontToBack = frontToBack;
+	std::stable_sort(submitOrder.begin(), submitOrder.end(), compare);
+
+	for (unsigned int index = 0; index < submitOrder.size(); ++index) {
+		const SubmittedDraw& submitted = submittedDraws[submitOrder[index]];
+		const CommandBuffer::Draw& draw = submitted.buffer->getDraw(submitted.index);
+
+		for (unsigned int flag = 0; flag < ERF_COUNT; ++flag) {
+			const bool value = (submitted.flags & (1 << flag)) != 0;
+			if (renderFlags[flag] != value) {
+				setFlag((RenderFlag)flag, value);
+			}
+		}
+		for (unsigned int unit = 0; unit < MaxTextureCount; ++unit) {
+			if (activeTexture[unit] != submitted.texture[unit]) {
+				setActiveTexture(unit, submitted.texture[unit]);
+			}
+		}
+		if (activeShader != submitted.shader) {
+			setShader(submitted.shader);
+		}
+
+		// The shader itself stays shared, only its uniform pointer moves
+		void* uniform = submitted.buffer->getUniform(draw);
+		if ((uniform != NULL) && (activeShader != NULL)) {
+			activeShader->uniform = uniform;
+		}
+
+		if (draw.instanceCount != 0) {
+			renderInstanced(draw.primitiveType, draw.vertices, draw.vertexCount, draw.instanceData, draw.instanceCount);
+		} else if (draw.indices != NULL) {
+			render(draw.primitiveType, draw.vertices, draw.vertexCount, draw.indices, draw.indexCount);
+		} else {
+			render(draw.primitiveType, draw.vertices, draw.vertexCount);
+		}
+	}
+}
+
+void Renderer::submit(CommandBuffer* buffer, bool frontToBack) {
+	submit(&buffer, 1, frontToBack);
 }
 /*
 void Renderer::draw2DLine(const vec2& begin, const vec2& end, const vec4& color) {
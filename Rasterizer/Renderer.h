@@ -7,6 +7,14 @@
 #include "RenderTarget.h"
 
 #include "Shader.h"
+#include "Light.h"
+#include "LightGrid.h"
+#include "ThreadPool.h"
+#include "SpanCoverage.h"
+
+#include <vector>
+
+class CommandBuffer;
 
 typedef void (*VertexShaderCallback)(VertexShaderData&);
 typedef void (*PixelShaderCallback)(PixelShaderData&);
@@ -17,35 +25,223 @@ public:
 		ERF_DEPTH_TEST,
 		ERF_DEPTH_MASK,
 		ERF_ALPHA_BLEND,
+		ERF_DEPTH_ONLY,
+		ERF_GBUFFER,
+		ERF_ORDER_INDEPENDENT,
 		GFX_PERSPECTIVE_CORRECT,
 		GFX_WIREFRAME,
 
 		ERF_COUNT
 	};
 
+	enum PrimitiveType {
+		EPT_LINES,
+		EPT_LINE_STRIP,
+		EPT_TRIANGLES,
+		EPT_TRIANGLE_STRIP
+	};
+
 private:
 	vec4 viewport;
 	mat4 viewportTransformation;
 	mat4 orthogonalProjection;
 	bool renderFlags[ERF_COUNT];
 	const Image* activeTexture[MaxTextureCount];
+	const LightGrid* lightGrid;
 	RenderTarget* renderTarget;
 	Image* depthBufferPtr;
 	Image* colorBufferPtr;
 
+	// ERT_COLOR_1 to ERT_COLOR_3, albedo, normal and material of a G-buffer
+	Image* geometryBufferPtr[3];
+
 	Shader* activeShader;
 
+	// Varyings of the current draw, from the active shader
+	unsigned int varyingCount;
+
+	// Instance being drawn by renderInstanced(), 0 otherwise
+	int activeInstance;
+
+	// Picked once at startup from the CPU features
+	SpanCoverageFunction spanCoverage;
+	SpanCoverageFunction spanFill;
+
+	// Vertex after the vertex shader. data stays in clip space for the
+	// clipper, screen is the viewport position with 1 / w in place of w
+	struct TransformedVertex {
+		VertexShaderData data;
+		vec4 screen;
+		unsigned int clipCode;
+	};
+
+	// Every vertex of the current draw, transformed before any rasterization
+	std::vector<TransformedVertex> vertexCache;
+	VertexBatch vertexBatch;
+	float vertexBatchScreen[4][VertexBatchSize];
+
+	// Raw view of the render target, resolved once per draw. color is NULL
+	// when the buffers have to go through the Image interface
+	struct TargetView {
+		uint8_t* color;
+		float* depth;
+		unsigned int colorStride;
+
+		// Depth row length, in samples
+		unsigned int width;
+
+		// R8G8B8A8 G-buffer attachments, same size as the color buffer
+		uint8_t* geometry[3];
+		unsigned int geometryStride;
+
+		// Order independent draws append blended fragments here instead of
+		// blending them into the color buffer, NULL otherwise
+		FragmentBuffer* fragments;
+	};
+	TargetView target;
+
+	// Color buffer size, or depth buffer size for depth only targets, in
+	// pixels. Buffers of a multisampled target are sampleCount times wider
+	uvec2 targetSize;
+	unsigned int sampleCount;
+
+	// NULL when the render target has no valid hierarchical Z for this draw
+	HierarchicalZ* hierarchicalZ;
+
+	// Planes of a Triangle, one per interpolated value
+	enum AttributePlane {
+		EAP_DEPTH = 0,
+		EAP_INV_W = 1,
+		EAP_NORMAL = 2,
+		EAP_COLOR = EAP_NORMAL + 4,
+		EAP_UV = EAP_COLOR + 4,
+		EAP_VARYING = EAP_UV + 2,
+
+		EAP_COUNT = EAP_VARYING + MaxVaryingCount * 4
+	};
+
+	// Screen space triangle, ready to be rasterized
+	struct Triangle {
+		vec4 position[3];
+		float area;
+		float maxDepth;
+
+		// 28.4 fixed point edge functions at pixel centers, value = origin +
+		// dx * x + dy * y, biased by the fill rule so a covered pixel has all
+		// three >= 0
+		int64_t edgeOrigin[3];
+		int edgeDx[3];
+		int edgeDy[3];
+
+		// value = origin + dx * x + dy * y at pixel centers. uv and varyings
+		// are premultiplied by 1 / w when perspective correct
+		float planeOrigin[EAP_COUNT];
+		float planeDx[EAP_COUNT];
+		float planeDy[EAP_COUNT];
+		int minX;
+		int minY;
+		int maxX;
+		int maxY;
+		int instance;
+	};
+
+	// Binning is only used when more than one thread renders
+	static const int TileSize = HierarchicalZ::TileSize;
+	ThreadPool* threadPool;
+	uvec2 tileCount;
+	std::vector<Triangle> triangles;
+	std::vector<std::vector<unsigned int> > tileBins;
+	std::vector<unsigned int> activeTiles;
+
 	void drawLine(const vec3&, const vec4&, const vec3&, const vec4&);
-	void drawTriangle(const Vertex&, const Vertex&, const Vertex&);
+	void drawTriangle(const TransformedVertex&, const TransformedVertex&, const TransformedVertex&);
+	void clipTriangle(const TransformedVertex&, const TransformedVertex&, const TransformedVertex&, unsigned int);
+	void submitTriangle(const TransformedVertex&, const TransformedVertex&, const TransformedVertex&);
+	bool setupTriangle(const TransformedVertex&, const TransformedVertex&, const TransformedVertex&, Triangle&);
+	bool isOccluded(const Triangle&) const;
+	void setupPlanes(const VertexShaderData&, const VertexShaderData&, const VertexShaderData&, Triangle&) const;
 
-public:
-	enum PrimitiveType {
-		EPT_LINES,
-		EPT_LINE_STRIP,
-		EPT_TRIANGLES,
-		EPT_TRIANGLE_STRIP
+	void processVertices(const Vertex* vertices, unsigned int vertexCount);
+	void drawPrimitives(const PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount);
+	vec4 projectVertex(const vec4& position) const;
+
+	const TransformedVertex& fetchVertex(unsigned int index) const {
+		return vertexCache[index];
+	}
+	void rasterizeTriangle(const Triangle&, int, int, int, int);
+
+	// Span writer specialized on the color format and on every flag the raster loop reads.
+	// Spans and masks hold two rows of sampleCount entries each
+	typedef void (Renderer::*ShadeSpanFunction)(const Triangle&, const SpanCoverage*, const unsigned int*, int, int);
+	ShadeSpanFunction shadeSpan;
+
+	template <unsigned int ColorFormat, bool DepthTest, bool DepthMask, bool AlphaBlend, bool PerspectiveCorrect, bool DepthOnly, bool GBuffer, bool Multisample>
+	void shadeSpanT(const Triangle&, const SpanCoverage*, const unsigned int*, int, int);
+
+	// Indexed by [format][flags], see getSpanVariant()
+	static const unsigned int SpanFormatCount = 3;
+	static const unsigned int SpanFlagCount = 128;
+	static const ShadeSpanFunction ShadeSpanTable[SpanFormatCount][SpanFlagCount];
+	unsigned int spanVariantDraws[SpanFormatCount * SpanFlagCount];
+	unsigned int spanVariant;
+
+	// False when the draw has nothing to write to, a depth only target only
+	// takes ERF_DEPTH_ONLY draws
+	bool bindTarget();
+
+	void beginBinning();
+	void flushBins();
+	static void RasterizeTileTask(void* userData, unsigned int taskIndex, unsigned int threadIndex);
+
+	// State of the running renderLights() pass, shared by every tile
+	struct LightPass {
+		TargetView target;
+		const Light* lights;
+		unsigned int lightCount;
+		mat4 screenToWorld;
+		vec3 eyePosition;
 	};
-	
+	LightPass lightPass;
+
+	void shadeLights(int minX, int minY, int maxX, int maxY);
+	static void ShadeLightsTask(void* userData, unsigned int taskIndex, unsigned int threadIndex);
+
+	void compositeFragments(int minX, int minY, int maxX, int maxY);
+	static void CompositeFragmentsTask(void* userData, unsigned int taskIndex, unsigned int threadIndex);
+
+	// Recorded draw with its state resolved against the renderer, sorted by submit()
+	struct SubmittedDraw {
+		CommandBuffer* buffer;
+		unsigned int index;
+		unsigned int flags;
+		Shader* shader;
+		const Image* texture[MaxTextureCount];
+
+		// Ids in order of first use, so equal states sort the same way every frame
+		unsigned int shaderId;
+		unsigned int textureId[MaxTextureCount];
+		bool ordered;
+		float depth;
+	};
+	std::vector<SubmittedDraw> submittedDraws;
+	std::vector<const void*> submittedStates;
+
+	// Indices into submittedDraws, sorted instead of the draws themselves
+	std::vector<unsigned int> submitOrder;
+
+	static bool SubmitOrder(const SubmittedDraw& a, const SubmittedDraw& b);
+	static bool SubmitOrderFrontToBack(const SubmittedDraw& a, const SubmittedDraw& b);
+
+	struct SubmitCompare {
+		const SubmittedDraw* draws;
+		bool frontToBack;
+
+		bool operator () (unsigned int a, unsigned int b) const {
+			return frontToBack ? SubmitOrderFrontToBack(draws[a], draws[b]) : SubmitOrder(draws[a], draws[b]);
+		}
+	};
+
+public:
 	Renderer();
 	
 	~Renderer();
@@ -72,9 +268,88 @@ public:
 	
 	Shader* getShader() const;
 
+	/*************************************************************************/
+	/* Handed to pixel shaders as PixelShaderData::lights, so they only loop */
+	/* over the lights of their tile. The grid has to be built for the       */
+	/* current frame before drawing.                                         */
+	/*************************************************************************/
+	void setLightGrid(const LightGrid* grid);
+
+	const LightGrid* getLightGrid() const;
+
+	/*************************************************************************/
+	/* With more than one thread every draw call is binned into 64x64 tiles  */
+	/* which are rasterized in parallel before render() returns.             */
+	/*************************************************************************/
+	void setThreadCount(unsigned int count);
+
+	unsigned int getThreadCount() const;
+
+	/*************************************************************************/
+	/* Span writer variants. A variant is format * 128 + flags, format being */
+	/* 0 for the generic Image path, 1 for R8G8B8A8 and 2 for R8G8B8, flags  */
+	/* being depth test 1, depth mask 2, alpha blend 4, perspective 8, depth */
+	/* only 16, G-buffer 32 and multisample 64.                              */
+	/*************************************************************************/
+	unsigned int getSpanVariant() const;
+
+	unsigned int getSpanVariantDraws(unsigned int variant) const;
+
+	void printSpanVariants() const;
+
+	void resetSpanVariants();
+
 	void render(const PrimitiveType primitiveType, const Vertex* vertices, unsigned int vertexCount);
 
 	void render(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount, const unsigned int* indices, const unsigned int indexCount);
+
+	/*************************************************************************/
+	/* Draws vertices instanceCount times with a single target setup and a   */
+	/* single rasterization pass. The active shader sees instanceData as     */
+	/* Shader::instanceData and the instance in VertexShaderData::instance   */
+	/* and PixelShaderData::instance, Shader::uniform is shared by all.      */
+	/*************************************************************************/
+	void renderInstanced(const PrimitiveType primitiveType, const Vertex* vertices, const unsigned int vertexCount, const void* instanceData, const unsigned int instanceCount);
+
+	/*************************************************************************/
+	/* Runs the draws of several command buffers as one sorted list, then    */
+	/* leaves the state of the last draw like immediate drawing would.       */
+	/* Opaque draws are grouped by shader, textures and flags, front to      */
+	/* back within a group, or front to back first with frontToBack. Draws   */
+	/* blending in order come last, in recording order, buffer by buffer.    */
+	/* State only changes between draws that differ.                         */
+	/*************************************************************************/
+	void submit(CommandBuffer* const* buffers, unsigned int bufferCount, bool frontToBack = false);
+
+	void submit(CommandBuffer* buffer, bool frontToBack = false);
+
+	/*************************************************************************/
+	/* Deferred lighting. Draws made with ERF_GBUFFER store albedo, normal   */
+	/* and PixelShaderData::material in ERT_COLOR_1 to ERT_COLOR_3 instead   */
+	/* of shading ERT_COLOR_0. This pass then lights every pixel with a      */
+	/* depth once, writing ERT_COLOR_0. Positions are rebuilt from the depth */
+	/* buffer with viewProjection, the one the G-buffer was drawn with.      */
+	/*************************************************************************/
+	void renderLights(const Light* lights, unsigned int lightCount, const mat4& viewProjection, const vec3& eyePosition);
+
+	/*************************************************************************/
+	/* Multisample resolve. Averages the samples of every pixel of the       */
+	/* render target color buffer into destination, which has to be the      */
+	/* size of the image. Coverage is tested at RenderTarget::MaxSampleCount */
+	/* positions per pixel, the pixel shader still runs once per pixel and   */
+	/* depth and color are stored per sample.                                */
+	/*************************************************************************/
+	void resolve(Image* destination);
+
+	/*************************************************************************/
+	/* Order independent transparency. With ERF_ORDER_INDEPENDENT, blended   */
+	/* draws append their fragments to the per pixel lists of the render     */
+	/* target instead of blending them in submission order, and write no     */
+	/* depth. This pass sorts every list by depth and blends it back to      */
+	/* front over ERT_COLOR_0, dropping fragments behind the final depth     */
+	/* buffer, then empties the lists. Multisampled targets blend in order.  */
+	/*************************************************************************/
+	void resolveTransparency();
 /*
 	void draw2DLine(const vec2& begin, const vec2& end, const vec4& color = vec4(1.0f, 1.0f, 1.0f, 1.0f));
 
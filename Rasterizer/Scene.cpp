@@ -0,0 +1,347 @@
+#include <math.h>
+
+#include "Scene.h"
+
+// Leaves grow by this part of their largest side on every side
+static const float LeafMargin = 0.1f;
+
+// Half the surface area, the cost of a box in the tree
+static inline float getArea(const vec3& minimum, const vec3& maximum) {
+	const vec3 size = maximum - minimum;
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static inline float getUnionArea(const vec3& minimumA, const vec3& maximumA, const vec3& minimumB, const vec3& maximumB) {
+	const vec3 minimum(fminf(minimumA.x, minimumB.x), fminf(minimumA.y, minimumB.y), fminf(minimumA.z, minimumB.z));
+	const vec3 maximum(fmaxf(maximumA.x, maximumB.x), fmaxf(maximumA.y, maximumB.y), fmaxf(maximumA.z, maximumB.z));
+	return getArea(minimum, maximum);
+}
+
+static inline bool contains(const vec3& outerMinimum, const vec3& outerMaximum, const vec3& minimum, const vec3& maximum) {
+	return (outerMinimum.x <= minimum.x) && (outerMinimum.y <= minimum.y) && (outerMinimum.z <= minimum.z) &&
+		(outerMaximum.x >= maximum.x) && (outerMaximum.y >= maximum.y) && (outerMaximum.z >= maximum.z);
+}
+
+Scene::Scene() {
+	root = NullIndex;
+	freeNodes = NullIndex;
+	objectCount = 0;
+}
+
+unsigned int Scene::allocateNode() {
+	if (freeNodes == NullIndex) {
+		nodes.push_back(Node());
+		freeNodes = nodes.size() - 1;
+		nodes[freeNodes].parent = NullIndex;
+	}
+
+	const unsigned int node = freeNodes;
+	freeNodes = nodes[node].parent;
+
+	nodes[node].parent = NullIndex;
+	nodes[node].children[0] = NullIndex;
+	nodes[node].children[1] = NullIndex;
+	nodes[node].object = NullIndex;
+	nodes[node].height = 0;
+
+	return node;
+}
+
+void Scene::freeNode(unsigned int node) {
+	nodes[node].parent = freeNodes;
+	nodes[node].height = -1;
+	freeNodes = node;
+}
+
+void Scene::insertLeaf(unsigned int leaf) {
+	if (root == NullIndex) {
+		root = leaf;
+		nodes[root].parent = NullIndex;
+		return;
+	}
+
+	// Walks down to the sibling with the least area added to the tree
+	const vec3 leafMinimum = nodes[leaf].minimum;
+	const vec3 leafMaximum = nodes[leaf].maximum;
+	unsigned int sibling = root;
+	while (nodes[sibling].object == NullIndex) {
+		const Node& node = nodes[sibling];
+		const float area = getArea(node.minimum, node.maximum);
+		const float unionArea = getUnionArea(node.minimum, node.maximum, leafMinimum, leafMaximum);
+
+		// A new parent right here, or the growth of this node plus the cost further down
+		const float cost = 2.0f * unionArea;
+		const float inheritedCost = 2.0f * (unionArea - area);
+
+		float childCost[2];
+		for (unsigned int index = 0; index < 2; ++index) {
+			const Node& child = nodes[node.children[index]];
+			const float childUnionArea = getUnionArea(child.minimum, child.maximum, leafMinimum, leafMaximum);
+			if (child.object != NullIndex) {
+				childCost[index] = childUnionArea + inheritedCost;
+			} else {
+				childCost[index] = childUnionArea - getArea(child.minimum, child.maximum) + inheritedCost;
+			}
+		}
+
+		if ((cost < childCost[0]) && (cost < childCost[1])) {
+			break;
+		}
+
+		sibling = node.children[(childCost[0] < childCost[1]) ? 0 : 1];
+	}
+
+	const unsigned int oldParent = nodes[sibling].parent;
+	const unsigned int newParent = allocateNode();
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].children[0] = sibling;
+	nodes[newParent].children[1] = leaf;
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent == NullIndex) {
+		root = newParent;
+	} else if (nodes[oldParent].children[0] == sibling) {
+		nodes[oldParent].children[0] = newParent;
+	} else {
+		nodes[oldParent].children[1] = newParent;
+	}
+
+	refit(newParent);
+}
+
+void Scene::removeLeaf(unsigned int leaf) {
+	if (leaf == root) {
+		root = NullIndex;
+		return;
+	}
+
+	const unsigned int parent = nodes[leaf].parent;
+	const unsigned int grandParent = nodes[parent].parent;
+	const unsigned int sibling = (nodes[parent].children[0] == leaf) ? nodes[parent].children[1] : nodes[parent].children[0];
+
+	// The sibling takes the place of the parent
+	nodes[sibling].parent = grandParent;
+	freeNode(parent);
+
+	if (grandParent == NullIndex) {
+		root = sibling;
+		return;
+	}
+
+	if (nodes[grandParent].children[0] == parent) {
+		nodes[grandParent].children[0] = sibling;
+	} else {
+		nodes[grandParent].children[1] = sibling;
+	}
+
+	refit(grandParent);
+}
+
+void Scene::refit(unsigned int node) {
+	while (node != NullIndex) {
+		node = rotate(node);
+
+		Node& current = nodes[node];
+		const Node& child0 = nodes[current.children[0]];
+		const Node& child1 = nodes[current.children[1]];
+		current.minimum = vec3(fminf(child0.minimum.x, child1.minimum.x), fminf(child0.minimum.y, child1.minimum.y), fminf(child0.minimum.z, child1.minimum.z));
+		current.maximum = vec3(fmaxf(child0.maximum.x, child1.maximum.x), fmaxf(child0.maximum.y, child1.maximum.y), fmaxf(child0.maximum.z, child1.maximum.z));
+		current.height = 1 + ((child0.height > child1.height) ? child0.height : child1.height);
+
+		node = current.parent;
+	}
+}
+
+/*****************************************************************************/
+/* When one child of the node is more than one level taller than the other,  */
+/* the taller child takes the place of the node, and the node takes the      */
+/* shorter grandchild of it. Returns the node now at the place of node.      */
+/*****************************************************************************/
+unsigned int Scene::rotate(unsigned int node) {
+	Node& a = nodes[node];
+	if (a.height < 2) {
+		return node;
+	}
+
+	const int balance = nodes[a.children[1]].height - nodes[a.children[0]].height;
+	if ((balance >= -1) && (balance <= 1)) {
+		return node;
+	}
+
+	// The taller child moves up, the node keeps the shorter one
+	const unsigned int tallSide = (balance > 1) ? 1 : 0;
+	const unsigned int up = a.children[tallSide];
+	const unsigned int kept = a.children[1 - tallSide];
+	Node& b = nodes[up];
+
+	b.parent = a.parent;
+	a.parent = up;
+	if (b.parent == NullIndex) {
+		root = up;
+	} else if (nodes[b.parent].children[0] == node) {
+		nodes[b.parent].children[0] = up;
+	} else {
+		nodes[b.parent].children[1] = up;
+	}
+
+	// The taller grandchild stays with the moved up child, the other one goes to the node
+	const unsigned int tallGrandChild = (nodes[b.children[0]].height > nodes[b.children[1]].height) ? b.children[0] : b.children[1];
+	const unsigned int shortGrandChild = (tallGrandChild == b.children[0]) ? b.children[1] : b.children[0];
+	b.children[0] = node;
+	b.children[1] = tallGrandChild;
+	a.children[tallSide] = shortGrandChild;
+	nodes[shortGrandChild].parent = node;
+
+	const Node& keptNode = nodes[kept];
+	const Node& shortNode = nodes[shortGrandChild];
+	a.minimum = vec3(fminf(keptNode.minimum.x, shortNode.minimum.x), fminf(keptNode.minimum.y, shortNode.minimum.y), fminf(keptNode.minimum.z, shortNode.minimum.z));
+	a.maximum = vec3(fmaxf(keptNode.maximum.x, shortNode.maximum.x), fmaxf(keptNode.maximum.y, shortNode.maximum.y), fmaxf(keptNode.maximum.z, shortNode.maximum.z));
+	a.height = 1 + ((keptNode.height > shortNode.height) ? keptNode.height : shortNode.height);
+
+	return up;
+}
+
+void Scene::placeObject(unsigned int object) {
+	Object& current = objects[object];
+	Mesh* mesh = current.mesh;
+
+	mesh->updateTransformation();
+	if (!mesh->updateBounds()) {
+		if (current.leaf != NullIndex) {
+			removeLeaf(current.leaf);
+			freeNode(current.leaf);
+			current.leaf = NullIndex;
+		}
+		return;
+	}
+
+	mesh->getWorldBox(current.minimum, current.maximum);
+	if ((current.leaf != NullIndex) && contains(nodes[current.leaf].minimum, nodes[current.leaf].maximum, current.minimum, current.maximum)) {
+		return;
+	}
+
+	if (current.leaf == NullIndex) {
+		current.leaf = allocateNode();
+		nodes[current.leaf].object = object;
+	} else {
+		removeLeaf(current.leaf);
+	}
+
+	const vec3 size = current.maximum - current.minimum;
+	const float largestSide = fmaxf(size.x, fmaxf(size.y, size.z));
+	const vec3 margin(largestSide * LeafMargin, largestSide * LeafMargin, largestSide * LeafMargin);
+	nodes[current.leaf].minimum = current.minimum - margin;
+	nodes[current.leaf].maximum = current.maximum + margin;
+
+	insertLeaf(current.leaf);
+}
+
+unsigned int Scene::add(Mesh* mesh) {
+	unsigned int object;
+	if (freeObjects.empty()) {
+		objects.push_back(Object());
+		object = objects.size() - 1;
+	} else {
+		object = freeObjects.back();
+		freeObjects.pop_back();
+	}
+
+	objects[object].mesh = mesh;
+	objects[object].leaf = NullIndex;
+	++objectCount;
+
+	placeObject(object);
+
+	return object;
+}
+
+void Scene::remove(unsigned int object) {
+	Object& current = objects[object];
+	if (current.mesh == NULL) {
+		return;
+	}
+
+	if (current.leaf != NullIndex) {
+		removeLeaf(current.leaf);
+		freeNode(current.leaf);
+	}
+
+	current.mesh = NULL;
+	current.leaf = NullIndex;
+	freeObjects.push_back(object);
+	--objectCount;
+}
+
+void Scene::update(unsigned int object) {
+	if (objects[object].mesh != NULL) {
+		placeObject(object);
+	}
+}
+
+Mesh* Scene::getMesh(unsigned int object) const {
+	return objects[object].mesh;
+}
+
+unsigned int Scene::getObjectCount() const {
+	return objectCount;
+}
+
+int Scene::getHeight() const {
+	return (root == NullIndex) ? 0 : nodes[root].height;
+}
+
+void Scene::cull(const Frustum& frustum, std::vector<unsigned int>& visibleObjects) {
+	if (root == NullIndex) {
+		return;
+	}
+
+	// Node and the planes it still has to be tested against
+	const unsigned int allPlanes = Frustum::AllPlanes;
+	stack.clear();
+	stack.push_back(root);
+	stack.push_back(allPlanes);
+
+	while (!stack.empty()) {
+		unsigned int planeMask = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if ((planeMask != 0) && frustum.isBoxOutside(node.minimum, node.maximum, planeMask)) {
+			continue;
+		}
+
+		if (node.object == NullIndex) {
+			stack.push_back(node.children[0]);
+			stack.push_back(planeMask);
+			stack.push_back(node.children[1]);
+			stack.push_back(planeMask);
+			continue;
+		}
+
+		// The leaf is larger than the mesh, planes it crosses have to be tested again
+		const Object& object = objects[node.object];
+		if ((planeMask != 0) && frustum.isBoxOutside(object.minimum, object.maximum, planeMask)) {
+			continue;
+		}
+
+		visibleObjects.push_back(node.object);
+	}
+}
+
+unsigned int Scene::record(CommandBuffer* commands, const mat4& viewProjection, const Frustum& frustum) {
+	visible.clear();
+	cull(frustum, visible);
+
+	for (unsigned int index = 0; index < visible.size(); ++index) {
+		const Mesh* mesh = objects[visible[index]].mesh;
+		mesh->record(commands, viewProjection, mesh->normalMatrix);
+	}
+
+	return visible.size();
+}
+
+unsigned int Scene::record(CommandBuffer* commands, const Camera& camera) {
+	return record(commands, camera.viewProjection, camera.frustum);
+}
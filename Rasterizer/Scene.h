@@ -0,0 +1,113 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <vector>
+
+#include "Vector.h"
+#include "Frustum.h"
+#include "Camera.h"
+#include "Mesh.h"
+#include "CommandBuffer.h"
+
+/*****************************************************************************/
+/* Meshes placed in the world, with a dynamic bounding volume hierarchy over */
+/* their world boxes. Every leaf keeps a box a little larger than its mesh,  */
+/* so small moves leave the tree alone. Culling is a single traversal that   */
+/* stops at subtrees outside the frustum and stops testing inside subtrees   */
+/* completely in it. The scene does not own the meshes, which have to live   */
+/* as long as they are in it.                                                */
+/*****************************************************************************/
+class Scene {
+public:
+	// Missing node, leaf or object
+	static const unsigned int NullIndex = 0xffffffff;
+
+private:
+	struct Node {
+		vec3 minimum;
+		vec3 maximum;
+
+		// Next free node while the node is unused
+		unsigned int parent;
+		unsigned int children[2];
+
+		// Leaves only, NullIndex for inner nodes
+		unsigned int object;
+
+		// 0 for leaves
+		int height;
+	};
+
+	struct Object {
+		Mesh* mesh;
+
+		// NullIndex for unused objects and empty meshes
+		unsigned int leaf;
+
+		// Box of the mesh itself, smaller than the one of its leaf
+		vec3 minimum;
+		vec3 maximum;
+	};
+
+	std::vector<Node> nodes;
+	unsigned int root;
+	unsigned int freeNodes;
+
+	std::vector<Object> objects;
+	std::vector<unsigned int> freeObjects;
+	unsigned int objectCount;
+
+	// Kept between frames, so culling does not allocate
+	std::vector<unsigned int> stack;
+	std::vector<unsigned int> visible;
+
+	unsigned int allocateNode();
+	void freeNode(unsigned int node);
+
+	void insertLeaf(unsigned int leaf);
+	void removeLeaf(unsigned int leaf);
+
+	// Fixes boxes and heights from node up to the root, rotating where needed
+	void refit(unsigned int node);
+	unsigned int rotate(unsigned int node);
+
+	void placeObject(unsigned int object);
+
+public:
+	Scene();
+
+	/*************************************************************************/
+	/* Adds a mesh at its position, rotation and scale, and returns the      */
+	/* object used by the other calls.                                       */
+	/*************************************************************************/
+	unsigned int add(Mesh* mesh);
+
+	void remove(unsigned int object);
+
+	/*************************************************************************/
+	/* Updates the object after its mesh moved, rotated, scaled or changed   */
+	/* vertices. Objects that did not change cost nothing per frame.         */
+	/*************************************************************************/
+	void update(unsigned int object);
+
+	Mesh* getMesh(unsigned int object) const;
+
+	unsigned int getObjectCount() const;
+
+	// Longest path from the root to a leaf, 0 for a single object
+	int getHeight() const;
+
+	// Appends the objects inside of the frustum
+	void cull(const Frustum& frustum, std::vector<unsigned int>& visibleObjects);
+
+	/*************************************************************************/
+	/* Records every object inside of the frustum, with the transformation   */
+	/* cached by add() and update(). Renderer::submit() then sorts the draws */
+	/* by state. Returns the number of recorded draws.                       */
+	/*************************************************************************/
+	unsigned int record(CommandBuffer* commands, const mat4& viewProjection, const Frustum& frustum);
+
+	unsigned int record(CommandBuffer* commands, const Camera& camera);
+};
+
+#endif // __SCENE_H__
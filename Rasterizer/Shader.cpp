@@ -4,25 +4,59 @@
 
 Shader::Shader() {
 	uniform = NULL;
-	totalVaryingData = NULL;
-	varying = NULL;
 	varyingCount = 0;
+	instanceData = NULL;
 }
 
 Shader::~Shader() {
-	if (varying != NULL) {
-		delete [] varying;
-	}
 }
 	
 void Shader::allocVarying(const unsigned int count) {
-	totalVaryingData = new vec4[count * 4];
-	varyingCount = count;
+	varyingCount = (count < MaxVaryingCount) ? count : MaxVaryingCount;
 }
 	
 void Shader::vertexShader(VertexShaderData& vertexSahderData) {
 }
 	
+void Shader::vertexShaderBatch(VertexBatch& batch) {
+	VertexShaderData vertex;
+
+	for (unsigned int index = 0; index < batch.count; ++index) {
+		vertex.position = vec4(batch.position[0][index], batch.position[1][index], batch.position[2][index], batch.position[3][index]);
+		vertex.normal = vec4(batch.normal[0][index], batch.normal[1][index], batch.normal[2][index], batch.normal[3][index]);
+		vertex.color = vec4(batch.color[0][index], batch.color[1][index], batch.color[2][index], batch.color[3][index]);
+		vertex.uv = vec2(batch.uv[0][index], batch.uv[1][index]);
+		vertex.index = batch.index[index];
+		vertex.instance = batch.instance;
+		for (unsigned int slot = 0; slot < varyingCount; ++slot) {
+			vertex.varying[slot] = vec4(batch.varying[slot][0][index], batch.varying[slot][1][index], batch.varying[slot][2][index], batch.varying[slot][3][index]);
+		}
+
+		vertexShader(vertex);
+
+		batch.position[0][index] = vertex.position.x;
+		batch.position[1][index] = vertex.position.y;
+		batch.position[2][index] = vertex.position.z;
+		batch.position[3][index] = vertex.position.w;
+		batch.normal[0][index] = vertex.normal.x;
+		batch.normal[1][index] = vertex.normal.y;
+		batch.normal[2][index] = vertex.normal.z;
+		batch.normal[3][index] = vertex.normal.w;
+		batch.color[0][index] = vertex.color.x;
+		batch.color[1][index] = vertex.color.y;
+		batch.color[2][index] = vertex.color.z;
+		batch.color[3][index] = vertex.color.w;
+		batch.uv[0][index] = vertex.uv.x;
+		batch.uv[1][index] = vertex.uv.y;
+		for (unsigned int slot = 0; slot < varyingCount; ++slot) {
+			batch.varying[slot][0][index] = vertex.varying[slot].x;
+			batch.varying[slot][1][index] = vertex.varying[slot].y;
+			batch.varying[slot][2][index] = vertex.varying[slot].z;
+			batch.varying[slot][3][index] = vertex.varying[slot].w;
+		}
+	}
+}
+	
 bool Shader::pixelShader(PixelShaderData& pixelShaderData) {
 	return true;
 }
\ No newline at end of file
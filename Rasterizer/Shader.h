@@ -3,37 +3,76 @@
 
 #include "Vector.h"
 #include "Image.h"
+#include "VertexBatch.h"
 
 static const unsigned int MaxTextureCount = 4;
 
+class LightGrid;
+
 struct VertexShaderData {
 	vec4 position;
 	vec4 normal;
 	vec4 color;
 	vec2 uv;
+	vec4 varying[MaxVaryingCount];
 	int index;
+
+	// Instance of Renderer::renderInstanced, 0 for every other draw
+	int instance;
 };
 
 struct PixelShaderData {
 	const Image* texture[MaxTextureCount];
+
+	// Renderer::setLightGrid, NULL when none is set
+	const LightGrid* lights;
+
+	// Render target pixel, y pointing up like LightGrid tiles
+	int x;
+	int y;
+
+	// Same as VertexShaderData::instance
+	int instance;
+
 	vec4 normal;
 	vec4 color;
 	vec2 uv;
+	vec4 varying[MaxVaryingCount];
+
+	// Only stored by G-buffer draws, specular intensity in x and shininess
+	// / 256 in y, see Light::evaluate
+	vec4 material;
+
+	// Screen space derivatives of uv, per 2x2 quad
+	vec2 uvDx;
+	vec2 uvDy;
 };
 
 struct Shader {
 	void *uniform;
-	vec4 *totalVaryingData;
-	vec4 *varying;
 	unsigned int varyingCount;
+
+	// Renderer::renderInstanced data, NULL outside of instanced draws
+	const void* instanceData;
 	
 	Shader();
 	
 	virtual ~Shader();
 	
+	/*************************************************************************/
+	/* Number of VertexShaderData::varying entries the vertex shader writes. */
+	/* They reach PixelShaderData::varying perspective correct interpolated. */
+	/* Clamped to MaxVaryingCount.                                           */
+	/*************************************************************************/
 	void allocVarying(const unsigned int count);
 	
 	virtual void vertexShader(VertexShaderData& vertexSahderData);
+
+	/*************************************************************************/
+	/* Transforms a whole batch per call. The default implementation runs    */
+	/* vertexShader on every vertex, override it to work on the arrays.      */
+	/*************************************************************************/
+	virtual void vertexShaderBatch(VertexBatch& batch);
 	
 	virtual bool pixelShader(PixelShaderData& pixelShaderData);
 };
@@ -0,0 +1,138 @@
+#include <math.h>
+
+#include "ShadowMap.h"
+#include "Renderer.h"
+
+ShadowMap::ShadowMap() {
+	viewProjection.setIdentity();
+	viewportTransformation.setIdentity();
+	previousTarget = NULL;
+	previousFlags[0] = false;
+	previousFlags[1] = false;
+	bias = 0.002f;
+}
+
+void ShadowMap::create(const uvec2& size) {
+	depthBuffer.create(size, Image::EPF_DEPTH);
+	depthBuffer.wrapping.x = Image::EWT_DISCARD;
+	depthBuffer.wrapping.y = Image::EWT_DISCARD;
+	renderTarget.setBuffer(RenderTarget::ERT_DEPTH, &depthBuffer);
+	viewportTransformation.setViewport(0.0f, 0.0f, (float)size.x, (float)size.y);
+}
+
+uvec2 ShadowMap::getSize() const {
+	return depthBuffer.getSize();
+}
+
+bool ShadowMap::setup(const Light& light, const vec3& center, float radius) {
+	mat4 view;
+	mat4 projection;
+
+	if (light.type == Light::ELT_DIRECTIONAL) {
+		// Back off along the light so the whole sphere is in front of the near plane
+		const vec3 up = (fabsf(light.direction.y) > 0.99f) ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+		view.setCameraLookAtTransformation(center - light.direction * (radius * 2.0f), center, up);
+		projection.setOrthogonal(-radius, radius, radius, -radius, radius, radius * 3.0f);
+	} else if (light.type == Light::ELT_SPOT) {
+		const vec3 up = (fabsf(light.direction.y) > 0.99f) ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+		view.setCameraLookAtTransformation(light.position, light.position + light.direction, up);
+		projection.setPerspective(rad2deg(acosf(light.spotCutoff)) * 2.0f, 1.0f, light.range * 0.01f, light.range);
+	} else {
+		return false;
+	}
+
+	viewProjection = projection * view;
+	return true;
+}
+
+const mat4& ShadowMap::getViewProjection() const {
+	return viewProjection;
+}
+
+void ShadowMap::begin(Renderer* renderer) {
+	previousTarget = renderer->getRenderTarget();
+	previousViewport = renderer->getViewport();
+	previousFlags[0] = renderer->getFlag(Renderer::ERF_DEPTH_ONLY);
+	previousFlags[1] = renderer->getFlag(Renderer::ERF_GBUFFER);
+
+	const uvec2& size = depthBuffer.getSize();
+	renderer->setRenderTarget(&renderTarget);
+	renderer->setViewport(vec4(0.0f, 0.0f, (float)size.x, (float)size.y));
+	renderer->setFlag(Renderer::ERF_DEPTH_ONLY, true);
+	renderer->setFlag(Renderer::ERF_GBUFFER, false);
+
+	// Through the render target, so the hierarchical Z rejects hidden casters
+	renderTarget.clearDepth();
+}
+
+void ShadowMap::end(Renderer* renderer) {
+	renderer->setRenderTarget(previousTarget);
+	renderer->setViewport(previousViewport);
+	renderer->setFlag(Renderer::ERF_DEPTH_ONLY, previousFlags[0]);
+	renderer->setFlag(Renderer::ERF_GBUFFER, previousFlags[1]);
+}
+
+// Shadow map pixel in x and y, with y pointing up, and depth in z. Depth is
+// negative for anything the light view does not see
+vec3 ShadowMap::project(const vec3& worldPosition) const {
+	const vec4 clip = viewProjection * vec4(worldPosition, 1.0f);
+	if ((clip.w <= 0.0f) || (clip.z + clip.w < 0.0f)) {
+		return vec3(0.0f, 0.0f,-1.0f);
+	}
+
+	// Same transformations as the rasterizer
+	const float invW = 1.0f / clip.w;
+	const vec4 screen = viewportTransformation * vec4(clip.x * invW, clip.y * invW, clip.z * invW, 1.0f);
+	return vec3(screen.x, screen.y, 1.0f - screen.z);
+}
+
+bool ShadowMap::isLit(int x, int y, float depth) const {
+	const uvec2& size = depthBuffer.getSize();
+	if ((x < 0) || (y < 0) || (x >= (int)size.x) || (y >= (int)size.y)) {
+		return true;
+	}
+
+	const float* data = (const float*)depthBuffer.getData();
+	return depth + bias >= data[(size.y - 1 - y) * size.x + x];
+}
+
+float ShadowMap::sample(const vec3& worldPosition) const {
+	const vec3 position = project(worldPosition);
+	if ((position.z < 0.0f) || (position.z > 1.0f)) {
+		return 1.0f;
+	}
+
+	return isLit((int)floorf(position.x), (int)floorf(position.y), position.z) ? 1.0f : 0.0f;
+}
+
+float ShadowMap::samplePCF(const vec3& worldPosition, int radius) const {
+	const vec3 position = project(worldPosition);
+	if ((position.z < 0.0f) || (position.z > 1.0f)) {
+		return 1.0f;
+	}
+
+	// Texel centers are at + 0.5, the first and last row and column get the
+	// bilinear weights so the kernel slides smoothly
+	const float x = position.x - 0.5f;
+	const float y = position.y - 0.5f;
+	const int x0 = (int)floorf(x);
+	const int y0 = (int)floorf(y);
+	const float fractionX = x - x0;
+	const float fractionY = y - y0;
+
+	float lit = 0.0f;
+	for (int row = -radius; row <= radius + 1; ++row) {
+		const float weightY = (row == -radius) ? 1.0f - fractionY : ((row == radius + 1) ? fractionY : 1.0f);
+
+		for (int column = -radius; column <= radius + 1; ++column) {
+			const float weightX = (column == -radius) ? 1.0f - fractionX : ((column == radius + 1) ? fractionX : 1.0f);
+
+			if (isLit(x0 + column, y0 + row, position.z)) {
+				lit += weightX * weightY;
+			}
+		}
+	}
+
+	const float kernelSize = (float)(radius * 2 + 1);
+	return lit / (kernelSize * kernelSize);
+}
@@ -0,0 +1,74 @@
+#ifndef __SHADOW_MAP_H__
+#define __SHADOW_MAP_H__
+
+#include "Vector.h"
+#include "Matrix4.h"
+#include "Image.h"
+#include "RenderTarget.h"
+#include "Light.h"
+
+class Renderer;
+
+/*****************************************************************************/
+/* Depth of the scene seen from a light, in an EPF_DEPTH image without any   */
+/* color buffer. Draws between begin() and end() go through ERF_DEPTH_ONLY,  */
+/* so they skip every attribute plane and the pixel shader. Like every depth */
+/* buffer of the renderer, larger depth is closer to the light.              */
+/*****************************************************************************/
+class ShadowMap {
+	Image depthBuffer;
+	RenderTarget renderTarget;
+	mat4 viewProjection;
+	mat4 viewportTransformation;
+
+	// Renderer state replaced by begin()
+	RenderTarget* previousTarget;
+	vec4 previousViewport;
+	bool previousFlags[2];
+
+	vec3 project(const vec3& worldPosition) const;
+	bool isLit(int x, int y, float depth) const;
+
+public:
+	// Depth offset toward the light, against surfaces shadowing themselves
+	float bias;
+
+	ShadowMap();
+
+	void create(const uvec2& size);
+
+	uvec2 getSize() const;
+
+	/*************************************************************************/
+	/* Directional lights get an orthographic projection around a bounding   */
+	/* sphere of the shadow casters. Spot lights get a perspective one over  */
+	/* their cone, out to range, and ignore the sphere. Point lights would   */
+	/* need six faces and return false.                                      */
+	/*************************************************************************/
+	bool setup(const Light& light, const vec3& center, float radius);
+
+	const mat4& getViewProjection() const;
+
+	/*************************************************************************/
+	/* Binds the shadow map as the render target of renderer and clears it.  */
+	/* Draw the casters with getViewProjection(), then end() restores the    */
+	/* previous render target, viewport and flags.                           */
+	/*************************************************************************/
+	void begin(Renderer* renderer);
+
+	void end(Renderer* renderer);
+
+	/*************************************************************************/
+	/* 1 where worldPosition is lit, 0 in shadow. Positions outside of the   */
+	/* light view are lit.                                                   */
+	/*************************************************************************/
+	float sample(const vec3& worldPosition) const;
+
+	/*************************************************************************/
+	/* Percentage closer filtering over (2 * radius + 1)^2 texels, bilinear  */
+	/* weighted at the border so the result is smooth across texels.         */
+	/*************************************************************************/
+	float samplePCF(const vec3& worldPosition, int radius = 1) const;
+};
+
+#endif // __SHADOW_MAP_H__
@@ -0,0 +1,131 @@
+#include <stdio.h>
+
+#include "SpanCoverage.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPAN_COVERAGE_X86
+#include <immintrin.h>
+#endif
+
+template <bool EdgeTest>
+static unsigned int ComputeSpanCoverageScalar(const int edge[3], const int edgeStep[3], float depth, float depthStep, SpanCoverage& span) {
+	unsigned int mask = 0;
+
+	for (unsigned int lane = 0; lane < SpanWidth; ++lane) {
+		const int e0 = edge[0] + edgeStep[0] * (int)lane;
+		const int e1 = edge[1] + edgeStep[1] * (int)lane;
+		const int e2 = edge[2] + edgeStep[2] * (int)lane;
+
+		span.depth[lane] = depth + depthStep * lane;
+
+		if ((EdgeTest == false || ((e0 | e1 | e2) >= 0)) && (span.depth[lane] >= 0.0f) && (span.depth[lane] <= 1.0f)) {
+			mask |= 1 << lane;
+		}
+	}
+
+	return mask;
+}
+
+#if defined(SPAN_COVERAGE_X86)
+template <bool EdgeTest>
+__attribute__((target("sse2")))
+static unsigned int ComputeSpanCoverageSSE(const int edge[3], const int edgeStep[3], float depth, float depthStep, SpanCoverage& span) {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	unsigned int mask = 0;
+
+	// SSE2 has no 32 bit multiply, the lane offsets are built on the scalar side
+	const __m128i step0 = _mm_setr_epi32(0, edgeStep[0], edgeStep[0] * 2, edgeStep[0] * 3);
+	const __m128i step1 = _mm_setr_epi32(0, edgeStep[1], edgeStep[1] * 2, edgeStep[1] * 3);
+	const __m128i step2 = _mm_setr_epi32(0, edgeStep[2], edgeStep[2] * 2, edgeStep[2] * 3);
+
+	// Two 4 pixel halves
+	for (unsigned int half = 0; half < SpanWidth; half += 4) {
+		const __m128 lane = _mm_setr_ps(half + 0.0f, half + 1.0f, half + 2.0f, half + 3.0f);
+		const __m128i e0 = _mm_add_epi32(_mm_set1_epi32(edge[0] + edgeStep[0] * (int)half), step0);
+		const __m128i e1 = _mm_add_epi32(_mm_set1_epi32(edge[1] + edgeStep[1] * (int)half), step1);
+		const __m128i e2 = _mm_add_epi32(_mm_set1_epi32(edge[2] + edgeStep[2] * (int)half), step2);
+
+		const __m128 z = _mm_add_ps(_mm_set1_ps(depth), _mm_mul_ps(_mm_set1_ps(depthStep), lane));
+
+		__m128 inside = _mm_cmpge_ps(z, zero);
+		if (EdgeTest) {
+			// Sign bit set if any of the three edges is negative
+			const __m128i outside = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), 31);
+			inside = _mm_andnot_ps(_mm_castsi128_ps(outside), inside);
+		}
+		inside = _mm_and_ps(inside, _mm_cmple_ps(z, one));
+
+		_mm_storeu_ps(span.depth + half, z);
+
+		mask |= _mm_movemask_ps(inside) << half;
+	}
+
+	return mask;
+}
+
+template <bool EdgeTest>
+__attribute__((target("avx2")))
+static unsigned int ComputeSpanCoverageAVX2(const int edge[3], const int edgeStep[3], float depth, float depthStep, SpanCoverage& span) {
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+	const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	const __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(edge[0]), _mm256_mullo_epi32(_mm256_set1_epi32(edgeStep[0]), laneIndex));
+	const __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(edge[1]), _mm256_mullo_epi32(_mm256_set1_epi32(edgeStep[1]), laneIndex));
+	const __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(edge[2]), _mm256_mullo_epi32(_mm256_set1_epi32(edgeStep[2]), laneIndex));
+
+	const __m256 z = _mm256_add_ps(_mm256_set1_ps(depth), _mm256_mul_ps(_mm256_set1_ps(depthStep), lane));
+
+	__m256 inside = _mm256_cmp_ps(z, zero, _CMP_GE_OQ);
+	if (EdgeTest) {
+		const __m256i outside = _mm256_srai_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), 31);
+		inside = _mm256_andnot_ps(_mm256_castsi256_ps(outside), inside);
+	}
+	inside = _mm256_and_ps(inside, _mm256_cmp_ps(z, one, _CMP_LE_OQ));
+
+	_mm256_storeu_ps(span.depth, z);
+
+	return _mm256_movemask_ps(inside);
+}
+#endif // SPAN_COVERAGE_X86
+
+SpanCoverageFunction GetSpanCoverageFunction() {
+#if defined(SPAN_COVERAGE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return ComputeSpanCoverageAVX2<true>;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return ComputeSpanCoverageSSE<true>;
+	}
+#endif
+	return ComputeSpanCoverageScalar<true>;
+}
+
+SpanCoverageFunction GetSpanFillFunction() {
+#if defined(SPAN_COVERAGE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return ComputeSpanCoverageAVX2<false>;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return ComputeSpanCoverageSSE<false>;
+	}
+#endif
+	return ComputeSpanCoverageScalar<false>;
+}
+
+const char* GetSpanCoverageName() {
+	const SpanCoverageFunction function = GetSpanCoverageFunction();
+#if defined(SPAN_COVERAGE_X86)
+	if (function == ComputeSpanCoverageAVX2<true>) {
+		return "AVX2";
+	}
+	if (function == ComputeSpanCoverageSSE<true>) {
+		return "SSE2";
+	}
+#endif
+	return "Scalar";
+}
@@ -0,0 +1,32 @@
+#ifndef __SPAN_COVERAGE_H__
+#define __SPAN_COVERAGE_H__
+
+static const unsigned int SpanWidth = 8;
+
+// Per pixel results of a span, one lane per pixel
+struct SpanCoverage {
+	float depth[SpanWidth];
+};
+
+/*****************************************************************************/
+/* Tests SpanWidth pixels against the three fixed point edge functions.      */
+/* Edge values and depth are given for the first pixel and stepped by        */
+/* edgeStep and depthStep for every next pixel. Returns a coverage mask, bit */
+/* N set if all three edges of pixel N are >= 0 and its depth is in [0, 1].  */
+/*****************************************************************************/
+typedef unsigned int (*SpanCoverageFunction)(const int edge[3], const int edgeStep[3], float depth, float depthStep, SpanCoverage& span);
+
+/*****************************************************************************/
+/* Returns the widest implementation supported by the running CPU.           */
+/*****************************************************************************/
+SpanCoverageFunction GetSpanCoverageFunction();
+
+/*****************************************************************************/
+/* Same as above for spans known to be inside all three edges, only the      */
+/* depth range is tested.                                                    */
+/*****************************************************************************/
+SpanCoverageFunction GetSpanFillFunction();
+
+const char* GetSpanCoverageName();
+
+#endif // __SPAN_COVERAGE_H__
@@ -0,0 +1,119 @@
+#include <stdio.h>
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool() {
+	callback = NULL;
+	userData = NULL;
+	taskCount = 0;
+	nextTask = 0;
+	generation = 0;
+	busyWorkers = 0;
+	running = false;
+}
+
+ThreadPool::~ThreadPool() {
+	destroy();
+}
+
+bool ThreadPool::initialize(unsigned int threadCount) {
+	destroy();
+
+	if (threadCount == 0) {
+		return false;
+	}
+
+	running = true;
+
+	for (unsigned int index = 0; index < threadCount - 1; ++index) {
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, index));
+	}
+
+	return true;
+}
+
+void ThreadPool::destroy() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		running = false;
+	}
+	wakeCondition.notify_all();
+
+	for (unsigned int index = 0; index < workers.size(); ++index) {
+		workers[index].join();
+	}
+	workers.clear();
+}
+
+unsigned int ThreadPool::getThreadCount() const {
+	return workers.size() + 1;
+}
+
+void ThreadPool::executeTasks(unsigned int threadIndex) {
+	unsigned int taskIndex;
+	while ((taskIndex = nextTask.fetch_add(1)) < taskCount) {
+		callback(userData, taskIndex, threadIndex);
+	}
+}
+
+void ThreadPool::workerLoop(unsigned int threadIndex) {
+	unsigned int lastGeneration = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (running && (generation == lastGeneration)) {
+				wakeCondition.wait(lock);
+			}
+			if (running == false) {
+				return;
+			}
+			lastGeneration = generation;
+		}
+
+		executeTasks(threadIndex);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (--busyWorkers == 0) {
+				doneCondition.notify_one();
+			}
+		}
+	}
+}
+
+void ThreadPool::run(TaskCallback ncallback, void* nuserData, unsigned int ntaskCount) {
+	if (ntaskCount == 0) {
+		return;
+	}
+
+	callback = ncallback;
+	userData = nuserData;
+	taskCount = ntaskCount;
+	nextTask = 0;
+
+	// Not worth waking anybody up for a single task
+	if (workers.empty() || (ntaskCount == 1)) {
+		executeTasks(workers.size());
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		busyWorkers = workers.size();
+		++generation;
+	}
+	wakeCondition.notify_all();
+
+	executeTasks(workers.size());
+
+	std::unique_lock<std::mutex> lock(mutex);
+	while (busyWorkers > 0) {
+		doneCondition.wait(lock);
+	}
+}
+
+unsigned int ThreadPool::GetHardwareThreadCount() {
+	const unsigned int count = std::thread::hardware_concurrency();
+	return (count > 0) ? count : 1;
+}
@@ -0,0 +1,61 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+class ThreadPool {
+public:
+	typedef void (*TaskCallback)(void* userData, unsigned int taskIndex, unsigned int threadIndex);
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wakeCondition;
+	std::condition_variable doneCondition;
+
+	TaskCallback callback;
+	void* userData;
+	unsigned int taskCount;
+	std::atomic<unsigned int> nextTask;
+
+	unsigned int generation;
+	unsigned int busyWorkers;
+	bool running;
+
+	// Make the copy operation illegal
+	ThreadPool(const ThreadPool&) {}
+	ThreadPool& operator = (const ThreadPool&) {return *this;}
+
+	void workerLoop(unsigned int threadIndex);
+
+	void executeTasks(unsigned int threadIndex);
+
+public:
+	ThreadPool();
+
+	~ThreadPool();
+
+	/*************************************************************************/
+	/* Spawns threadCount - 1 workers. The thread calling run() is the last  */
+	/* one and takes tasks as well.                                          */
+	/*************************************************************************/
+	bool initialize(unsigned int threadCount);
+
+	void destroy();
+
+	unsigned int getThreadCount() const;
+
+	/*************************************************************************/
+	/* Calls callback(userData, index, thread) for index in [0, taskCount)   */
+	/* and returns once every task finished.                                 */
+	/*************************************************************************/
+	void run(TaskCallback callback, void* userData, unsigned int taskCount);
+
+	static unsigned int GetHardwareThreadCount();
+};
+
+#endif // __THREAD_POOL_H__
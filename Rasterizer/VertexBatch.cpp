@@ -0,0 +1,67 @@
+#include <stdio.h>
+
+#include "VertexBatch.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void TransformBatch(const mat4& matrix, float* x, float* y, float* z, float* w, unsigned int count) {
+	unsigned int index = 0;
+
+#if defined(__SSE2__)
+	const __m128 m0  = _mm_set1_ps(matrix[ 0]);
+	const __m128 m1  = _mm_set1_ps(matrix[ 1]);
+	const __m128 m2  = _mm_set1_ps(matrix[ 2]);
+	const __m128 m3  = _mm_set1_ps(matrix[ 3]);
+	const __m128 m4  = _mm_set1_ps(matrix[ 4]);
+	const __m128 m5  = _mm_set1_ps(matrix[ 5]);
+	const __m128 m6  = _mm_set1_ps(matrix[ 6]);
+	const __m128 m7  = _mm_set1_ps(matrix[ 7]);
+	const __m128 m8  = _mm_set1_ps(matrix[ 8]);
+	const __m128 m9  = _mm_set1_ps(matrix[ 9]);
+	const __m128 m10 = _mm_set1_ps(matrix[10]);
+	const __m128 m11 = _mm_set1_ps(matrix[11]);
+	const __m128 m12 = _mm_set1_ps(matrix[12]);
+	const __m128 m13 = _mm_set1_ps(matrix[13]);
+	const __m128 m14 = _mm_set1_ps(matrix[14]);
+	const __m128 m15 = _mm_set1_ps(matrix[15]);
+
+	for (; index + 4 <= count; index += 4) {
+		const __m128 vx = _mm_loadu_ps(x + index);
+		const __m128 vy = _mm_loadu_ps(y + index);
+		const __m128 vz = _mm_loadu_ps(z + index);
+		const __m128 vw = _mm_loadu_ps(w + index);
+
+		// Column-major, same as Matrix4::operator * (const Vector4&)
+		_mm_storeu_ps(x + index, _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(m0, vx), _mm_mul_ps(m4, vy)),
+			_mm_add_ps(_mm_mul_ps(m8, vz), _mm_mul_ps(m12, vw))));
+		_mm_storeu_ps(y + index, _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(m1, vx), _mm_mul_ps(m5, vy)),
+			_mm_add_ps(_mm_mul_ps(m9, vz), _mm_mul_ps(m13, vw))));
+		_mm_storeu_ps(z + index, _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(m2, vx), _mm_mul_ps(m6, vy)),
+			_mm_add_ps(_mm_mul_ps(m10, vz), _mm_mul_ps(m14, vw))));
+		_mm_storeu_ps(w + index, _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(m3, vx), _mm_mul_ps(m7, vy)),
+			_mm_add_ps(_mm_mul_ps(m11, vz), _mm_mul_ps(m15, vw))));
+	}
+#endif
+
+	for (; index < count; ++index) {
+		const vec4 result = matrix * vec4(x[index], y[index], z[index], w[index]);
+		x[index] = result.x;
+		y[index] = result.y;
+		z[index] = result.z;
+		w[index] = result.w;
+	}
+}
+
+void TransformBatchPositions(const mat4& matrix, VertexBatch& batch) {
+	TransformBatch(matrix, batch.position[0], batch.position[1], batch.position[2], batch.position[3], batch.count);
+}
+
+void TransformBatchNormals(const mat4& matrix, VertexBatch& batch) {
+	TransformBatch(matrix, batch.normal[0], batch.normal[1], batch.normal[2], batch.normal[3], batch.count);
+}
@@ -0,0 +1,38 @@
+#ifndef __VERTEX_BATCH_H__
+#define __VERTEX_BATCH_H__
+
+#include "Vector.h"
+#include "Matrix4.h"
+
+static const unsigned int VertexBatchSize = 64;
+
+// Upper limit of Shader::varyingCount
+static const unsigned int MaxVaryingCount = 8;
+
+/*****************************************************************************/
+/* Structure of arrays copy of up to VertexBatchSize vertices, one array per */
+/* component so a whole batch can be transformed 4 vertices at a time.       */
+/*****************************************************************************/
+struct VertexBatch {
+	float position[4][VertexBatchSize];
+	float normal[4][VertexBatchSize];
+	float color[4][VertexBatchSize];
+	float uv[2][VertexBatchSize];
+	float varying[MaxVaryingCount][4][VertexBatchSize];
+	int index[VertexBatchSize];
+
+	// A batch never mixes instances
+	int instance;
+	unsigned int count;
+};
+
+/*****************************************************************************/
+/* In place matrix * vec4 over the given component arrays.                   */
+/*****************************************************************************/
+void TransformBatch(const mat4& matrix, float* x, float* y, float* z, float* w, unsigned int count);
+
+void TransformBatchPositions(const mat4& matrix, VertexBatch& batch);
+
+void TransformBatchNormals(const mat4& matrix, VertexBatch& batch);
+
+#endif // __VERTEX_BATCH_H__
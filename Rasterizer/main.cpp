@@ -21,22 +21,96 @@
 #include "Camera.h"
 #include "Mesh.h"
 #include "Shader.h"
+#include "LightGrid.h"
+#include "ShadowMap.h"
+#include "Scene.h"
 
 struct TestShader : public Shader {
 	TestShader() 
 		: Shader() {
 	}
 
+	// Instanced draws pass one ShaderUniform per instance
+	const ShaderUniform* getUniform(int instance) const {
+		if (instanceData != NULL) {
+			return reinterpret_cast<const ShaderUniform*>(instanceData) + instance;
+		}
+		return reinterpret_cast<const ShaderUniform*>(uniform);
+	}
+
 	void vertexShader(VertexShaderData& vertex) {
-		if (uniform != NULL) {
-			const ShaderUniform* myUniform = reinterpret_cast<const ShaderUniform*>(uniform);
+		const ShaderUniform* myUniform = getUniform(vertex.instance);
+		if (myUniform != NULL) {
 			vertex.position = myUniform->modelViewProjectionMatrix * vertex.position;
+			vertex.normal = myUniform->normalMatrix * vertex.normal;
+		}
+	}
+
+	void vertexShaderBatch(VertexBatch& batch) {
+		const ShaderUniform* myUniform = getUniform(batch.instance);
+		if (myUniform != NULL) {
+			TransformBatchPositions(myUniform->modelViewProjectionMatrix, batch);
+			TransformBatchNormals(myUniform->normalMatrix, batch);
 		}
 	}
 
 	bool pixelShader(PixelShaderData& pixel) {
 		if (pixel.texture[0] != NULL) {
-			pixel.color *= pixel.texture[0]->sample2D(pixel.uv);
+			pixel.color *= pixel.texture[0]->sample2D(pixel.uv, pixel.uvDx, pixel.uvDy);
+		}
+		const ShaderUniform* myUniform = getUniform(pixel.instance);
+		if (myUniform != NULL) {
+			pixel.material = myUniform->material;
+		}
+		return true;
+	}
+};
+
+// Forward lighting through the light grid and shadows, the world position
+// is a varying
+struct LitShader : public TestShader {
+	vec3 eyePosition;
+	const ShadowMap* shadowMap;
+
+	LitShader()
+		: TestShader() {
+		shadowMap = NULL;
+		allocVarying(1);
+	}
+
+	void vertexShader(VertexShaderData& vertex) {
+		const ShaderUniform* myUniform = getUniform(vertex.instance);
+		if (myUniform != NULL) {
+			vertex.varying[0] = myUniform->modelMatrix * vertex.position;
+		}
+		TestShader::vertexShader(vertex);
+	}
+
+	void vertexShaderBatch(VertexBatch& batch) {
+		const ShaderUniform* myUniform = getUniform(batch.instance);
+		if (myUniform != NULL) {
+			for (unsigned int component = 0; component < 4; ++component) {
+				memcpy(batch.varying[0][component], batch.position[component], batch.count * sizeof(float));
+			}
+			TransformBatch(myUniform->modelMatrix, batch.varying[0][0], batch.varying[0][1], batch.varying[0][2], batch.varying[0][3], batch.count);
+		}
+		TestShader::vertexShaderBatch(batch);
+	}
+
+	bool pixelShader(PixelShaderData& pixel) {
+		TestShader::pixelShader(pixel);
+
+		const vec3 position(pixel.varying[0].x, pixel.varying[0].y, pixel.varying[0].z);
+		if (pixel.lights != NULL) {
+			vec3 normal(pixel.normal.x, pixel.normal.y, pixel.normal.z);
+			normal.normalize();
+			const vec3 albedo(pixel.color.x, pixel.color.y, pixel.color.z);
+			const vec3 color = pixel.lights->evaluate(pixel.x, pixel.y, position, normal, eyePosition, albedo, pixel.material);
+			pixel.color = vec4(fminf(color.x, 1.0f), fminf(color.y, 1.0f), fminf(color.z, 1.0f), pixel.color.w);
+		}
+		if (shadowMap != NULL) {
+			const float shadow = 0.5f + 0.5f * shadowMap->samplePCF(position);
+			pixel.color = vec4(pixel.color.x * shadow, pixel.color.y * shadow, pixel.color.z * shadow, pixel.color.w);
 		}
 		return true;
 	}
@@ -76,6 +150,7 @@ int main() {
 	RenderTarget renderTarget;
 	Image colorBuffer;
 	Image depthBuffer;
+	Image geometryBuffer[3];
 
 	colorBuffer.create(output.getSize(), output.getPixelFormat());
 	colorBuffer.wrapping.x = Image::EWT_DISCARD;
@@ -87,8 +162,28 @@ int main() {
 	depthBuffer.wrapping.y = Image::EWT_DISCARD;
 	renderTarget.setBuffer(RenderTarget::ERT_DEPTH, &depthBuffer);
 
+	// Albedo, normal and material of the deferred path
+	for (unsigned int index = 0; index < 3; ++index) {
+		geometryBuffer[index].create(output.getSize(), Image::EPF_R8G8B8A8);
+		renderTarget.setBuffer((RenderTarget::BufferType)(RenderTarget::ERT_COLOR_1 + index), &geometryBuffer[index]);
+	}
+
+	// 4x multisampled copy of the target, resolved into colorBuffer
+	RenderTarget multisampleTarget;
+	Image multisampleColorBuffer;
+	Image multisampleDepthBuffer;
+	const uvec2 multisampleSize(output.getSize().x * RenderTarget::MaxSampleCount, output.getSize().y);
+
+	multisampleColorBuffer.create(multisampleSize, output.getPixelFormat());
+	multisampleDepthBuffer.create(multisampleSize, Image::EPF_DEPTH);
+	multisampleTarget.setBuffer(RenderTarget::ERT_COLOR_0, &multisampleColorBuffer);
+	multisampleTarget.setBuffer(RenderTarget::ERT_DEPTH, &multisampleDepthBuffer);
+	multisampleTarget.setSampleCount(RenderTarget::MaxSampleCount);
+
 	renderer.setRenderTarget(&renderTarget);
 	renderer.setViewport(vec4(0.0f, 0.0f, (float)ScreenSize.x, (float)ScreenSize.y));
+	renderer.setThreadCount(ThreadPool::GetHardwareThreadCount());
+	printf("Span coverage: %s\n", GetSpanCoverageName());
 
 	/*************************************************************************/
 	/* Camera                                                                */
@@ -117,10 +212,15 @@ int main() {
 		return 3;
 	}
 
+	for (unsigned int index = 0; index < 3; ++index) {
+		texture[index].generateMipmaps();
+	}
+
 	/************************************************************************/
 	/* Shader                                                               */
 	/************************************************************************/
 	TestShader shader;
+	LitShader litShader;
 
 	/*************************************************************************/
 	/* Floor mesh                                                            */
@@ -168,6 +268,22 @@ int main() {
 	billboard.vertices = billboardVertices;
 	billboard.vertexCount = 6;
 
+	/*************************************************************************/
+	/* Props, a field of small cubes drawn as instances of CubeVertices      */
+	/*************************************************************************/
+	static const unsigned int PropSide = 24;
+	static const unsigned int PropCount = PropSide * PropSide;
+	mat4 propModels[PropCount];
+	ShaderUniform propUniforms[PropCount];
+
+	for (unsigned int index = 0; index < PropCount; ++index) {
+		const vec3 position(-45.0f + 90.0f * (index % PropSide) / (PropSide - 1), 1.0f, -95.0f + 90.0f * (index / PropSide) / (PropSide - 1));
+		propModels[index].setTransformation(position, vec3(0.0f, index * 37.0f, 0.0f), vec3(0.2f, 0.2f, 0.2f));
+		propUniforms[index].modelMatrix = propModels[index];
+		propUniforms[index].normalMatrix = propModels[index].getInverse().GetTranspose();
+		propUniforms[index].material = vec4(0.5f, 0.125f, 0.0f, 0.0f);
+	}
+
 	Mesh suzanne;
 	suzanne.loadObj("suzanne.obj");
 	suzanne.camera = &camera;
@@ -176,12 +292,75 @@ int main() {
 	suzanne.texture = &texture[2];
 	suzanne.shader = &shader;
 
+	// Coarser suzannes once she covers less than a quarter and a tenth of the screen height
+	suzanne.generateLod(0.25f, 0.25f);
+	suzanne.generateLod(0.06f, 0.1f);
+
+	// Same opaque meshes for the command buffer path, by object key
+	Scene scene;
+	Mesh* sceneMeshes[] = {&floor, &cube, NULL, &suzanne};
+	unsigned int sceneObjects[] = {Scene::NullIndex, Scene::NullIndex, Scene::NullIndex, Scene::NullIndex};
+
+	/*************************************************************************/
+	/* Lights                                                                */
+	/*************************************************************************/
+	static const unsigned int LightCount = 9;
+	Light lights[LightCount];
+
+	lights[0].type = Light::ELT_DIRECTIONAL;
+	lights[0].ambientColor = vec4(0.25f, 0.25f, 0.25f, 1.0f);
+	lights[0].difuseColor = vec4(0.4f, 0.4f, 0.4f, 1.0f);
+	lights[0].direction = vec3(-0.3f,-1.0f,-0.5f).normalize();
+
+	for (unsigned int index = 1; index < LightCount; ++index) {
+		const float angle = 360.0f * index / (LightCount - 1);
+		lights[index].type = Light::ELT_POINT;
+		lights[index].difuseColor = vec4(0.5f + 0.5f * cosf(deg2rad(angle)), 0.5f + 0.5f * cosf(deg2rad(angle + 120.0f)), 0.5f + 0.5f * cosf(deg2rad(angle + 240.0f)), 1.0f);
+		lights[index].specularColor = lights[index].difuseColor;
+		lights[index].position = vec3(35.0f, 12.0f,-50.0f);
+		lights[index].position.rotateXZBy(angle, vec3(0.0f, 0.0f,-50.0f));
+		lights[index].range = 40.0f;
+	}
+
+	// Many small lights over the floor for the tiled forward path
+	static const unsigned int GridLightSide = 16;
+	static const unsigned int GridLightCount = GridLightSide * GridLightSide + 1;
+	Light gridLights[GridLightCount];
+	LightGrid lightGrid;
+
+	gridLights[0] = lights[0];
+	for (unsigned int index = 1; index < GridLightCount; ++index) {
+		const unsigned int cell = index - 1;
+		const float angle = 360.0f * cell / (GridLightCount - 1) * 7.0f;
+		gridLights[index].type = Light::ELT_POINT;
+		gridLights[index].difuseColor = vec4(0.5f + 0.5f * cosf(deg2rad(angle)), 0.5f + 0.5f * cosf(deg2rad(angle + 120.0f)), 0.5f + 0.5f * cosf(deg2rad(angle + 240.0f)), 1.0f);
+		gridLights[index].specularColor = gridLights[index].difuseColor;
+		gridLights[index].position = vec3(-45.0f + 90.0f * (cell % GridLightSide) / (GridLightSide - 1), 2.0f, -95.0f + 90.0f * (cell / GridLightSide) / (GridLightSide - 1));
+		gridLights[index].range = 8.0f;
+	}
+	lightGrid.resize(output.getSize());
+
+	// Cast by the directional light, fitted around the floor
+	ShadowMap shadowMap;
+	shadowMap.create(uvec2(1024, 1024));
+	shadowMap.setup(lights[0], vec3(0.0f, 0.0f,-50.0f), 75.0f);
+
 	/*************************************************************************/
 	/* Misc variables                                                        */
 	/*************************************************************************/
 	bool drawObject[] = {true, true, true, true};
 	bool keys[] = {false, false, false, false};
 	bool running = true;
+	bool depthPrePass = false;
+	bool deferredShading = false;
+	bool tiledLighting = false;
+	bool shadows = false;
+	bool multisample = false;
+	bool orderIndependent = false;
+	bool recordDraws = false;
+	bool drawProps = false;
+	CommandBuffer commands;
+	float lightPhase = 0.0f;
 	Event event;	
 	float billAngle = 0.0f;
 	unsigned long long lastTime = Timer::GetMilliSeconds();
@@ -220,6 +399,39 @@ int main() {
 					case KEY_W :
 						printf("Wireframe: %s\n", renderer.toggleFlag(Renderer::GFX_WIREFRAME) ? "On" : "Off");
 						break;
+					case KEY_T :
+						renderer.setThreadCount((renderer.getThreadCount() > 1) ? 1 : ThreadPool::GetHardwareThreadCount());
+						printf("Render threads: %u\n", renderer.getThreadCount());
+						break;
+					case KEY_Z :
+						printf("Depth pre-pass: %s\n", (depthPrePass = !depthPrePass) ? "On" : "Off");
+						break;
+					case KEY_G :
+						printf("Deferred shading: %s\n", (deferredShading = !deferredShading) ? "On" : "Off");
+						break;
+					case KEY_L :
+						printf("Tiled forward lighting: %s\n", (tiledLighting = !tiledLighting) ? "On" : "Off");
+						break;
+					case KEY_S :
+						printf("Shadows: %s\n", (shadows = !shadows) ? "On" : "Off");
+						break;
+					case KEY_O :
+						printf("Order independent transparency: %s\n", (orderIndependent = !orderIndependent) ? "On" : "Off");
+						renderer.setFlag(Renderer::ERF_ORDER_INDEPENDENT, orderIndependent);
+						break;
+					case KEY_C :
+						printf("Command buffer: %s\n", (recordDraws = !recordDraws) ? "On" : "Off");
+						break;
+					case KEY_I :
+						printf("Instanced props: %s\n", (drawProps = !drawProps) ? "On" : "Off");
+						break;
+					case KEY_M :
+						printf("Multisampling: %s\n", (multisample = !multisample) ? "On" : "Off");
+						break;
+					case KEY_V :
+						renderer.printSpanVariants();
+						renderer.resetSpanVariants();
+						break;
 					case KEY_ESCAPE :
 						running = false;
 						break;
@@ -245,8 +457,14 @@ int main() {
 		}
 
 		// Clear the old frame data
-		colorBuffer.clear();
-		depthBuffer.clear();
+		RenderTarget* frameTarget = multisample ? &multisampleTarget : &renderTarget;
+		if (multisample) {
+			multisampleColorBuffer.clear();
+		} else {
+			colorBuffer.clear();
+		}
+		frameTarget->clearDepth();
+		renderer.setRenderTarget(frameTarget);
 
 		// Update camera transformations
 		if (keys[0]) {
@@ -272,26 +490,128 @@ int main() {
 
 		camera.update();
 
-		// Render the meshes
-		if (drawObject[0]) {
-			floor.draw(&renderer);
+		cube.rotation += vec3(0.33f, 0.66f, 0.99f);
+		suzanne.rotation.y += 0.2f;
+
+		// Casters from the light point of view, depth only
+		if (shadows) {
+			shadowMap.begin(&renderer);
+			if (drawObject[1]) {
+				cube.draw(&renderer, shadowMap.getViewProjection());
+			}
+			if (drawObject[3]) {
+				suzanne.draw(&renderer, shadowMap.getViewProjection());
+			}
+			shadowMap.end(&renderer);
 		}
+		litShader.shadowMap = shadows ? &shadowMap : NULL;
 
-		cube.rotation += vec3(0.33f, 0.66f, 0.99f);
-		if (drawObject[1]) {
-			cube.draw(&renderer);
+		// Lay down the opaque depth first, so the color pass only shades visible pixels
+		if (depthPrePass) {
+			renderer.setFlag(Renderer::ERF_DEPTH_ONLY, true);
+			if (drawObject[0]) {
+				floor.draw(&renderer);
+			}
+			if (drawObject[1]) {
+				cube.draw(&renderer);
+			}
+			if (drawObject[3]) {
+				suzanne.draw(&renderer);
+			}
+			renderer.setFlag(Renderer::ERF_DEPTH_ONLY, false);
 		}
 
-		suzanne.rotation.y += 0.2f;
-		if (drawObject[3]) {
-			suzanne.draw(&renderer);
+		// Tile depth bounds are only final after the pre-pass
+		if (tiledLighting) {
+			for (unsigned int index = 1; index < GridLightCount; ++index) {
+				gridLights[index].position.y = 2.0f + 1.5f * sinf(deg2rad(lightPhase + index * 40.0f));
+			}
+			lightPhase += 6.0f;
+			lightGrid.build(gridLights, GridLightCount, camera.viewProjection, renderer.getViewport(), depthPrePass ? &frameTarget->hierarchicalZ : NULL);
+			litShader.eyePosition = camera.position;
 		}
+		renderer.setLightGrid(tiledLighting ? &lightGrid : NULL);
+		// Deferred the lights are applied by renderLights, lit forward they would add up twice
+		floor.shader = (!deferredShading && (tiledLighting || shadows)) ? &litShader : &shader;
+		cube.shader = floor.shader;
+		suzanne.shader = floor.shader;
+
+		// Render the meshes, deferred they only fill the G-buffer
+		renderer.setFlag(Renderer::ERF_GBUFFER, deferredShading);
+
+		if (recordDraws) {
+			// The scene follows the object keys, only the moving meshes are updated
+			for (unsigned int index = 0; index < 4; ++index) {
+				if (sceneMeshes[index] == NULL) {
+					continue;
+				}
+				if (drawObject[index] && (sceneObjects[index] == Scene::NullIndex)) {
+					sceneObjects[index] = scene.add(sceneMeshes[index]);
+				} else if (!drawObject[index] && (sceneObjects[index] != Scene::NullIndex)) {
+					scene.remove(sceneObjects[index]);
+					sceneObjects[index] = Scene::NullIndex;
+				}
+			}
+			if (sceneObjects[1] != Scene::NullIndex) {
+				scene.update(sceneObjects[1]);
+			}
+			if (sceneObjects[3] != Scene::NullIndex) {
+				scene.update(sceneObjects[3]);
+			}
+
+			// Sorted by submit(), by state then front to back within a state
+			commands.reset();
+			scene.record(&commands, camera);
+			renderer.submit(&commands);
+		} else {
+			if (drawObject[0]) {
+				floor.draw(&renderer);
+			}
+
+			if (drawObject[1]) {
+				cube.draw(&renderer);
+			}
+
+			if (drawObject[3]) {
+				suzanne.draw(&renderer);
+			}
+		}
+
+		// One draw for every prop, only the matrices change per instance
+		if (drawProps) {
+			for (unsigned int index = 0; index < PropCount; ++index) {
+				propUniforms[index].modelViewProjectionMatrix = camera.viewProjection * propModels[index];
+			}
+			renderer.setActiveTexture(0, &texture[0]);
+			renderer.setFlag(Renderer::ERF_DEPTH_TEST, true);
+			renderer.setFlag(Renderer::ERF_DEPTH_MASK, true);
+			renderer.setFlag(Renderer::ERF_ALPHA_BLEND, false);
+			renderer.setShader(floor.shader);
+			renderer.renderInstanced(Renderer::EPT_TRIANGLES, CubeVertices, CubeVerticesCount, propUniforms, PropCount);
+		}
+
+		// Light every visible pixel once, blended geometry still goes forward
+		if (deferredShading) {
+			renderer.setFlag(Renderer::ERF_GBUFFER, false);
+
+			for (unsigned int index = 1; index < LightCount; ++index) {
+				lights[index].position.rotateXZBy(1.0f, vec3(0.0f, 0.0f,-50.0f));
+			}
+			renderer.renderLights(lights, LightCount, camera.viewProjection, camera.position);
+		}
+
+		renderer.setLightGrid(NULL);
 
 		billboard.position.rotateXZBy(0.5f, vec3(0.0f, 10.0f,-50.0f));
 		billboard.setTarget(camera.position);
 		if (drawObject[2]) {
 			billboard.draw(&renderer);
 		}
+		renderer.resolveTransparency();
+
+		if (multisample) {
+			renderer.resolve(&colorBuffer);
+		}
 
 		// Blit the final image to the output
 		output.blit(&colorBuffer);